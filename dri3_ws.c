@@ -28,16 +28,22 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 
 #include <X11/Xlib-xcb.h>
 #include <xcb/xcb.h>
 #include <X11/Xlibint.h>
 #include <xcb/dri3.h>
 #include <xcb/present.h>
+#include <xcb/xfixes.h>
+#include <X11/xshmfence.h>
 
 #include <services.h>
 
 #include "xhelpers.h"
+#include "pixconv.h"
 
 typedef Display *NativeDisplayType;
 typedef Window NativeWindowType;
@@ -57,46 +63,65 @@ typedef Pixmap NativePixmapType;
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <sys/mman.h>
 #endif
 
-// Capabilities of the X window system
+/*
+ * Capabilities of the X window system. EGL does not serialise calls into
+ * the plugin, which does its own locking. DRI3WS_EGL_LOCK selects the caps
+ * without WSEGL_CAP_UNLOCKED.
+ */
 static const WSEGLCaps s_driws_caps[] =
 {
-	{ WSEGL_CAP_MIN_SWAP_INTERVAL,	 1 },
-	{ WSEGL_CAP_MAX_SWAP_INTERVAL,	 1 },
+	{ WSEGL_CAP_MIN_SWAP_INTERVAL,	 0 },
+	{ WSEGL_CAP_MAX_SWAP_INTERVAL,	 DRI3WS_MAX_SWAP_INTERVAL },
+	{ WSEGL_CAP_WINDOWS_USE_HW_SYNC, 1 },
+	{ WSEGL_CAP_UNLOCKED,		 1 },
+	{ WSEGL_NO_CAPS,		 0 }
+};
+
+static const WSEGLCaps s_driws_caps_locked[] =
+{
+	{ WSEGL_CAP_MIN_SWAP_INTERVAL,	 0 },
+	{ WSEGL_CAP_MAX_SWAP_INTERVAL,	 DRI3WS_MAX_SWAP_INTERVAL },
 	{ WSEGL_CAP_WINDOWS_USE_HW_SYNC, 1 },
 	{ WSEGL_NO_CAPS,		 0 }
 };
 
+/*
+ * Displays and their ref counts. Everything else in a display is protected
+ * by its own lock.
+ */
 static struct driws_display *s_displays;
-static struct driws_buffer *s_buffers;
+static pthread_mutex_t s_displays_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline unsigned buffer_hash(xcb_pixmap_t pixmap)
+{
+	return pixmap & (DRI3WS_BUFFER_HASH_SIZE - 1);
+}
 
 static void add_buffer_to_list(struct driws_buffer *buffer)
 {
-	buffer->next = s_buffers;
-	s_buffers = buffer;
+	struct driws_buffer **head = &buffer->display->buffer_hash[buffer_hash(buffer->x_pixmap)];
+
+	buffer->next = *head;
+	*head = buffer;
 }
 
 static void remove_buffer_from_list(struct driws_buffer *buffer)
 {
-	for (struct driws_buffer *b = s_buffers, *prev = NULL; b; prev = b, b = b->next)
+	for (struct driws_buffer **p = &buffer->display->buffer_hash[buffer_hash(buffer->x_pixmap)]; *p; p = &(*p)->next)
 	{
-		if (b != buffer)
+		if (*p != buffer)
 			continue;
 
-		if (prev)
-			prev->next = buffer->next;
-		else
-			s_buffers = buffer->next;
-
+		*p = buffer->next;
 		break;
 	}
 }
 
-static struct driws_buffer *find_buffer_from_list(xcb_pixmap_t pixmap)
+static struct driws_buffer *find_buffer_from_list(struct driws_display *display, xcb_pixmap_t pixmap)
 {
-	for (struct driws_buffer *b = s_buffers; b; b = b->next) {
+	for (struct driws_buffer *b = display->buffer_hash[buffer_hash(pixmap)]; b; b = b->next) {
 		if (b->x_pixmap == pixmap)
 			return b;
 	}
@@ -140,6 +165,38 @@ static uint32_t format2gbmformat(WSEGLPixelFormat format)
 }
 #endif
 
+static enum pixconv_format format2pixconv(WSEGLPixelFormat format)
+{
+	switch (format) {
+	case WSEGL_PIXELFORMAT_RGB565:
+		return PIXCONV_RGB565;
+	case WSEGL_PIXELFORMAT_XRGB8888:
+		return PIXCONV_XRGB8888;
+	case WSEGL_PIXELFORMAT_ARGB8888:
+		return PIXCONV_ARGB8888;
+	default:
+		FAIL("unknown wsegl format");
+	}
+}
+
+// Format of a pixmap of the given depth, false for unsupported depths
+static bool depth2pixconv(uint32_t depth, enum pixconv_format *format)
+{
+	switch (depth) {
+	case 16:
+		*format = PIXCONV_RGB565;
+		return true;
+	case 24:
+		*format = PIXCONV_XRGB8888;
+		return true;
+	case 32:
+		*format = PIXCONV_ARGB8888;
+		return true;
+	default:
+		return false;
+	}
+}
+
 __attribute__((unused))
 static const char *format2str(WSEGLPixelFormat format)
 {
@@ -160,6 +217,33 @@ static uint32_t round_up_to(uint32_t x, uint32_t y)
 	return ((x + (y - 1)) / y) * y;
 }
 
+static void get_buffer_key(const struct driws_drawable *drawable, struct driws_buffer_key *key)
+{
+	uint32_t depth, bpp;
+
+	format2bytespp(drawable->wsegl_pixel_format, &depth, &bpp);
+
+	key->width = drawable->width;
+	key->height = drawable->height;
+	key->format = drawable->wsegl_pixel_format;
+	key->scanout = drawable->scanout;
+
+	if (key->scanout)
+		key->stride = round_up_to(drawable->width * (bpp / 8),
+					  drawable->display->scanout_pitch_align);
+	else
+		key->stride = round_up_to(drawable->width, 4) * (bpp / 8);
+}
+
+static bool buffer_key_equal(const struct driws_buffer_key *a, const struct driws_buffer_key *b)
+{
+	return a->width == b->width &&
+	       a->height == b->height &&
+	       a->format == b->format &&
+	       a->stride == b->stride &&
+	       a->scanout == b->scanout;
+}
+
 static struct driws_buffer *create_buffer(struct driws_drawable *drawable)
 {
 	struct driws_display *display = drawable->display;
@@ -169,17 +253,21 @@ static struct driws_buffer *create_buffer(struct driws_drawable *drawable)
 
 	struct driws_buffer *buffer = calloc(1, sizeof(*buffer));
 
+	buffer->display = display;
 	buffer->drawable = drawable;
 
+	get_buffer_key(drawable, &buffer->key);
+
 	uint32_t stride, width, height;
 
-	uint32_t buffer_width = round_up_to(drawable->width, 4);
+	uint32_t buffer_width = buffer->key.stride / (bpp / 8);
 
 #ifdef DRI3WS_USE_GBM
 	uint32_t gbm_format = format2gbmformat(drawable->wsegl_pixel_format);
 
 	DBG("BACKEND %s", gbm_device_get_backend_name(display->gbm));
 
+	// Scanout buffers differ only in their pitch alignment
 	struct gbm_bo* bo = gbm_bo_create(display->gbm, buffer_width, drawable->height,
 					  gbm_format, GBM_BO_USE_RENDERING | GBM_BO_USE_SCANOUT);
 	FAIL_IF(!bo, "no bo");
@@ -227,8 +315,8 @@ static struct driws_buffer *create_buffer(struct driws_drawable *drawable)
 	buffer->stride_pixels = stride / (bpp / 8);
 
 	// pvr map
-	PVRSRV_ERROR err = PVRSRVMapDmaBuf(&display->pvr_data.dev_data,
-					   display->pvr_data.h_mapping_heap,
+	PVRSRV_ERROR err = PVRSRVMapDmaBuf(&display->pvr_data->dev_data,
+					   display->pvr_data->h_mapping_heap,
 					   buffer->dmabuf_fd,
 					   // we need to mmap manually to deal with DRM mmap offset
 					   PVRSRV_MAP_NOUSERVIRTUAL,
@@ -245,6 +333,7 @@ static struct driws_buffer *create_buffer(struct driws_drawable *drawable)
 									      stride, depth, bpp,
 									      buffer->dmabuf_fd);
 	xcb_generic_error_t *error;
+	drawable->round_trips++;
 	if ((error = xcb_request_check(display->xcb_connection, pixmap_cookie))) {
 		FAIL("create pixmap failed");
 	}
@@ -282,15 +371,53 @@ static struct driws_buffer *create_buffer(struct driws_drawable *drawable)
 	return buffer;
 }
 
+static void trigger_wait_fence(void *data)
+{
+	struct driws_buffer *buffer = data;
+
+	xshmfence_trigger(buffer->wait_shm);
+}
+
+/*
+ * Reset the buffer's wait fence and have it triggered when the GPU is done
+ * with the buffer
+ */
+static void queue_fence_trigger(struct driws_buffer *buffer)
+{
+	struct pvr_completion *completion = &buffer->wait_completion;
+
+	// The previous trigger must have happened before the fence is reset,
+	// and the service may still be using the completion until then
+	WaitForCompletion(&buffer->display->completions, completion);
+
+	GetSyncPoint(buffer->pvr_meminfo->psClientSyncInfo, &completion->point);
+	completion->callback = trigger_wait_fence;
+	completion->data = buffer;
+
+	xshmfence_reset(buffer->wait_shm);
+
+	QueueCompletion(&buffer->display->completions, completion);
+}
+
 static void destroy_buffer(struct driws_buffer *buffer)
 {
-	struct driws_drawable *drawable = buffer->drawable;
-	struct driws_display *display = drawable->display;
+	struct driws_display *display = buffer->display;
 
 	DBG("bo=%p", buffer);
 
 	remove_buffer_from_list(buffer);
 
+	if (buffer->wait_shm) {
+		WaitForCompletion(&display->completions, &buffer->wait_completion);
+		x_destroy_shm_fence(display->xcb_connection, buffer->wait_fence, buffer->wait_shm);
+		buffer->wait_shm = NULL;
+	}
+
+	if (buffer->idle_shm) {
+		x_destroy_shm_fence(display->xcb_connection, buffer->idle_fence, buffer->idle_shm);
+		buffer->idle_shm = NULL;
+	}
+
 #ifdef DRI3WS_USE_GBM
 	gbm_bo_unmap(buffer->gbm_bo, buffer->gbm_map_data);
 #endif
@@ -302,7 +429,7 @@ static void destroy_buffer(struct driws_buffer *buffer)
 
 	xcb_free_pixmap(display->xcb_connection, buffer->x_pixmap);
 
-	PVRSRVUnmapDmaBuf(&display->pvr_data.dev_data, buffer->pvr_meminfo);
+	PVRSRVUnmapDmaBuf(&display->pvr_data->dev_data, buffer->pvr_meminfo);
 	buffer->pvr_meminfo = NULL;
 
 	close(buffer->dmabuf_fd);
@@ -322,486 +449,2334 @@ static void destroy_buffer(struct driws_buffer *buffer)
 	free(buffer);
 }
 
-static bool create_buffers(struct driws_drawable *drawable)
+static void pool_unlink(struct driws_buffer_pool *pool, struct driws_buffer *buffer)
 {
-	struct driws_display *display = drawable->display;
-	xcb_connection_t *c = display->xcb_connection;
+	if (buffer->pool_prev)
+		buffer->pool_prev->pool_next = buffer->pool_next;
+	else
+		pool->head = buffer->pool_next;
+
+	if (buffer->pool_next)
+		buffer->pool_next->pool_prev = buffer->pool_prev;
+	else
+		pool->tail = buffer->pool_prev;
+
+	buffer->pool_prev = buffer->pool_next = NULL;
+	pool->count--;
+}
 
-	//DBG("drawable %p", drawable);
+/*
+ * Take a buffer matching the drawable's current parameters from the pool,
+ * or allocate a new one.
+ */
+static struct driws_buffer *acquire_buffer(struct driws_drawable *drawable)
+{
+	struct driws_buffer_pool *pool = &drawable->display->pool;
+	struct driws_buffer_key key;
 
-	uint32_t width, height;
+	get_buffer_key(drawable, &key);
 
-	x_get_drawable_data(c, drawable->xcb_window, &width, &height);
+	for (struct driws_buffer *b = pool->head; b; b = b->pool_next) {
+		if (!buffer_key_equal(&b->key, &key))
+			continue;
 
-	if (drawable->buffers[0]) {
-		if (drawable->width == width && drawable->height == height)
-			return true;
-	}
+		pool_unlink(pool, b);
+		pool->hits++;
 
-	DBG("Create new buffers %ux%u", width, height);
+		b->drawable = drawable;
+		b->last_sbc = 0;
 
-	// XXX don't free the buffer that's currently used? could be on screen?
+		DBG("bo=%p reused from pool", b);
 
-	for (unsigned i = 0; i < ARRAY_SIZE(drawable->buffers); ++i) {
-		struct driws_buffer *buffer = drawable->buffers[i];
+		return b;
+	}
 
-		if (!buffer)
-			continue;
+	pool->misses++;
 
-		if (buffer->busy) {
-			ERR("WAAAAARNING: buffer busy when re-creating. Leaving it around\n");
-			continue;
-		}
+	return create_buffer(drawable);
+}
+
+/*
+ * Give a buffer back to the display. Idle buffers are kept in the pool for
+ * reuse, evicting the least recently released ones when the pool is full.
+ */
+static void release_buffer(struct driws_buffer *buffer)
+{
+	struct driws_buffer_pool *pool = &buffer->display->pool;
 
+	if (buffer->busy || pool->max_count == 0) {
 		destroy_buffer(buffer);
+		return;
 	}
 
-	drawable->width = width;
-	drawable->height = height;
+	buffer->drawable = NULL;
 
-	for (unsigned i = 0; i < ARRAY_SIZE(drawable->buffers); ++i)
-		drawable->buffers[i] = create_buffer(drawable);
+	buffer->pool_prev = NULL;
+	buffer->pool_next = pool->head;
+	if (pool->head)
+		pool->head->pool_prev = buffer;
+	else
+		pool->tail = buffer;
+	pool->head = buffer;
+	pool->count++;
 
-	DBG("new buffers allocated");
+	while (pool->count > pool->max_count) {
+		struct driws_buffer *b = pool->tail;
 
-	return true;
-}
+		pool_unlink(pool, b);
+		pool->evictions++;
 
-__attribute__((unused))
-static const char *get_complete_mode_str(uint8_t mode)
-{
-	switch (mode) {
-	case XCB_PRESENT_COMPLETE_MODE_FLIP:
-		return "FLIP";
-	case XCB_PRESENT_COMPLETE_MODE_COPY:
-		return "COPY";
-	case XCB_PRESENT_COMPLETE_MODE_SKIP:
-		return "SKIP";
-	default:
-		return "UNKNOWN";
+		destroy_buffer(b);
 	}
 }
 
-static void handle_special_event(struct driws_drawable *drawable, xcb_present_generic_event_t *ge)
+/*
+ * Drop a buffer from its swapchain. Buffers still in use by the server are
+ * queued until their IdleNotify arrives, see idle_buffer().
+ */
+static void retire_buffer(struct driws_buffer *buffer)
 {
-	switch (ge->evtype) {
-	case XCB_PRESENT_COMPLETE_NOTIFY: {
-		__attribute__((unused))
-		xcb_present_complete_notify_event_t *ce = (xcb_present_complete_notify_event_t*) ge;
-
-		//struct driws_buffer *buffer = drawable->buffers[ce->serial];
-
-		DBG("XCB_PRESENT_COMPLETE_NOTIFY %u, %s, msc %llu, ust %llu", ce->serial,
-		    get_complete_mode_str(ce->mode),
-		    (unsigned long long)ce->msc, (unsigned long long)ce->ust);
+	struct driws_display *display = buffer->display;
 
-		break;
+	if (!buffer->busy) {
+		release_buffer(buffer);
+		return;
 	}
 
-	case XCB_PRESENT_EVENT_IDLE_NOTIFY: {
-		xcb_present_idle_notify_event_t *ie = (xcb_present_idle_notify_event_t*) ge;
-
-		DBG("XCB_PRESENT_EVENT_IDLE_NOTIFY %u", ie->serial);
+	DBG("bo=%p busy, retiring", buffer);
 
-		struct driws_buffer *buffer = find_buffer_from_list(ie->pixmap);
+	buffer->retired = true;
+	buffer->retired_next = display->retired;
+	display->retired = buffer;
+}
 
-		if (buffer)
-			buffer->busy = false;
+static void unlink_retired_buffer(struct driws_buffer *buffer)
+{
+	for (struct driws_buffer **p = &buffer->display->retired; *p; p = &(*p)->retired_next) {
+		if (*p != buffer)
+			continue;
 
+		*p = buffer->retired_next;
 		break;
 	}
 
-	case XCB_PRESENT_EVENT_CONFIGURE_NOTIFY: {
-		__attribute__((unused))
-		xcb_present_configure_notify_event_t *ce = (xcb_present_configure_notify_event_t*) ge;
-		DBG("XCB_PRESENT_EVENT_CONFIGURE_NOTIFY %ux%u", ce->width, ce->height);
-		drawable->size_changed = true;
-		break;
-	}
+	buffer->retired_next = NULL;
+	buffer->retired = false;
+}
 
-	case XCB_PRESENT_EVENT_REDIRECT_NOTIFY: {
-		__attribute__((unused))
-		xcb_present_redirect_notify_event_t *re = (xcb_present_redirect_notify_event_t*) ge;
-		DBG("XCB_PRESENT_EVENT_REDIRECT_NOTIFY %u", re->serial);
+/*
+ * Destroy retired buffers belonging to the given drawable, or all of them
+ * if drawable is NULL. Used when no IdleNotify can arrive anymore.
+ */
+static void destroy_retired_buffers(struct driws_display *display, struct driws_drawable *drawable)
+{
+	struct driws_buffer **p = &display->retired;
 
-		break;
-	}
+	while (*p) {
+		struct driws_buffer *b = *p;
+
+		if (drawable && b->drawable != drawable) {
+			p = &b->retired_next;
+			continue;
+		}
 
+		*p = b->retired_next;
+		destroy_buffer(b);
 	}
-	free(ge);
 }
 
-static void poll_special_events(struct driws_drawable *drawable)
+/*
+ * The server has released the buffer
+ */
+static void idle_buffer(struct driws_buffer *buffer)
 {
-	struct xcb_connection_t *c = drawable->display->xcb_connection;
-	xcb_generic_event_t *ev;
+	buffer->busy = false;
 
-	while ((ev = xcb_poll_for_special_event(c, drawable->special_ev)) != NULL) {
-		xcb_present_generic_event_t *ge = (void *)ev;
-		handle_special_event(drawable, ge);
+	if (buffer->retired) {
+		unlink_retired_buffer(buffer);
+		release_buffer(buffer);
 	}
 }
 
-static void wait_special_event(struct driws_drawable *drawable)
+/*
+ * Check whether the server still uses the buffer. With idle fences this
+ * is answered from shared memory, without any events.
+ */
+static bool buffer_is_busy(struct driws_buffer *buffer)
 {
-	struct xcb_connection_t *c = drawable->display->xcb_connection;
-	xcb_generic_event_t *ev;
+	if (!buffer->busy)
+		return false;
 
-	ev = xcb_wait_for_special_event(c, drawable->special_ev);
-	handle_special_event(drawable, (xcb_present_generic_event_t*)ev);
+	if (buffer->idle_shm && xshmfence_query(buffer->idle_shm)) {
+		idle_buffer(buffer);
+		return false;
+	}
 
-	while ((ev = xcb_poll_for_special_event(c, drawable->special_ev)))
-		handle_special_event(drawable, (xcb_present_generic_event_t*)ev);
+	return true;
 }
 
-static WSEGLError WSEGL_IsDisplayValid(NativeDisplayType hNativeDisplay)
+/*
+ * Release retired buffers whose idle fence has been triggered. Their
+ * IdleNotify is not selected when idle fences are used.
+ */
+static void sweep_retired_buffers(struct driws_display *display)
 {
-	Display *dpy = (Display*)hNativeDisplay;
-
-	DBG("native %p", dpy);
+	struct driws_buffer *b = display->retired;
 
-	if (dpy == NULL)
-		return WSEGL_BAD_NATIVE_DISPLAY;
+	while (b) {
+		struct driws_buffer *next = b->retired_next;
 
-	xcb_connection_t *c = XGetXCBConnection(dpy);
-	if (!c)
-		return WSEGL_BAD_NATIVE_DISPLAY;
+		buffer_is_busy(b);
 
-	return WSEGL_SUCCESS;
+		b = next;
+	}
 }
 
-static WSEGLError WSEGL_InitialiseDisplay(NativeDisplayType hNativeDisplay,
-					  WSEGLDisplayHandle *phDisplay,
-					  const WSEGLCaps **psCapabilities,
-					  WSEGLConfig **psConfigs)
+static void drain_pool(struct driws_display *display)
 {
-	Display *dpy = hNativeDisplay;
+	struct driws_buffer_pool *pool = &display->pool;
 
-	DBG("native %p", hNativeDisplay);
+	while (pool->head) {
+		struct driws_buffer *b = pool->head;
 
-	for (struct driws_display *d = s_displays; d; d = d->next)
-	{
-		if (d->xdisplay != dpy)
-			continue;
+		pool_unlink(pool, b);
+		destroy_buffer(b);
+	}
+}
 
-		d->ref_count++;
+/*
+ * Import the storage of an X pixmap. The X server keeps the pixmap, so
+ * only the import is ours to release.
+ */
+static struct driws_import *import_pixmap(struct driws_display *display, xcb_pixmap_t pixmap)
+{
+	xcb_connection_t *c = display->xcb_connection;
 
-		*phDisplay = (WSEGLDisplayHandle)d;
-		*psCapabilities = s_driws_caps;
-		*psConfigs = d->wsegl_configs;
+	xcb_dri3_buffer_from_pixmap_cookie_t cookie = xcb_dri3_buffer_from_pixmap(c, pixmap);
+	xcb_dri3_buffer_from_pixmap_reply_t *reply = xcb_dri3_buffer_from_pixmap_reply(c, cookie, NULL);
+	if (!reply) {
+		ERR("BufferFromPixmap failed for pixmap 0x%x", pixmap);
+		return NULL;
+	}
 
-		return WSEGL_SUCCESS;
+	int *fds = xcb_dri3_buffer_from_pixmap_reply_fds(c, reply);
+
+	if (reply->nfd != 1 || fds[0] < 0) {
+		ERR("pixmap 0x%x: bad fd count %u", pixmap, reply->nfd);
+		for (unsigned i = 0; i < reply->nfd; ++i)
+			close(fds[i]);
+		free(reply);
+		return NULL;
 	}
 
-	xcb_connection_t *c = XGetXCBConnection(dpy);
-	FAIL_IF(!c, "XGetXCBConnection failed");
+	struct driws_import *import = calloc(1, sizeof(*import));
+	if (!import) {
+		close(fds[0]);
+		free(reply);
+		return NULL;
+	}
 
-	const xcb_setup_t *setup = xcb_get_setup(c);
-	FAIL_IF(!setup, "xcb_get_setup failed");
+	import->display = display;
+	import->pixmap = pixmap;
+	import->width = reply->width;
+	import->height = reply->height;
+	import->depth = reply->depth;
+	import->bpp = reply->bpp;
+	import->stride_bytes = reply->stride;
+	import->size = reply->size;
+	import->dmabuf_fd = fds[0];
 
-	/* get the first screen */
-	xcb_screen_t *screen = xcb_setup_roots_iterator(setup).data;
-	FAIL_IF(!screen, "failed to find screen");
+	free(reply);
 
-	x_check_dri3_ext(c, screen);
-	x_check_present_ext(c, screen);
+	DBG("pixmap 0x%x: fd %d, %ux%u, depth %u, bpp %u, stride %u", pixmap, import->dmabuf_fd,
+	    import->width, import->height, import->depth, import->bpp, import->stride_bytes);
 
-	int drm_fd = x_dri3_open(c, screen);
-	FAIL_IF(drm_fd < 0, "drm fd failed");
+	PVRSRV_ERROR err = PVRSRVMapDmaBuf(&display->pvr_data->dev_data,
+					   display->pvr_data->h_mapping_heap,
+					   import->dmabuf_fd,
+					   PVRSRV_MAP_NOUSERVIRTUAL,
+					   &import->pvr_meminfo);
+	if (err != PVRSRV_OK) {
+		ERR("Couldn't map pixmap 0x%x: %s", pixmap, PVRSRVGetErrorString(err));
+		close(import->dmabuf_fd);
+		free(import);
+		return NULL;
+	}
 
+	import->mmap = mmap(0, import->size, PROT_READ | PROT_WRITE, MAP_SHARED, import->dmabuf_fd, 0);
+	if (import->mmap == MAP_FAILED) {
+		ERR("Couldn't mmap pixmap 0x%x: %s", pixmap, strerror(errno));
+		PVRSRVUnmapDmaBuf(&display->pvr_data->dev_data, import->pvr_meminfo);
+		close(import->dmabuf_fd);
+		free(import);
+		return NULL;
+	}
 
-	struct driws_display *display = calloc(1, sizeof(*display));
+	return import;
+}
 
+static void destroy_import(struct driws_import *import)
+{
+	struct driws_display *display = import->display;
 
-	unsigned num_cfgs = 0;
+	DBG("pixmap 0x%x", import->pixmap);
 
-	for (xcb_depth_iterator_t depth_iter = xcb_screen_allowed_depths_iterator(screen);
-	     depth_iter.rem;
-	     xcb_depth_next(&depth_iter)) {
+	munmap(import->mmap, import->size);
+	PVRSRVUnmapDmaBuf(&display->pvr_data->dev_data, import->pvr_meminfo);
+	close(import->dmabuf_fd);
 
-		for (xcb_visualtype_iterator_t visual_iter = xcb_depth_visuals_iterator(depth_iter.data);
-		     visual_iter.rem;
-		     xcb_visualtype_next(&visual_iter)) {
-#if 0
-			// XXX BPP HACK
+	free(import);
+}
 
-			if (depth_iter.data->depth == 32 &&
-			    (visual_iter.data->red_mask == 0x00FF0000) &&
-			    (visual_iter.data->green_mask == 0x0000FF00) &&
-			    (visual_iter.data->blue_mask == 0x000000FF)) {
+static void unlink_import(struct driws_display *display, struct driws_import *import)
+{
+	for (struct driws_import **p = &display->imports; *p; p = &(*p)->next) {
+		if (*p != import)
+			continue;
 
-				display->wsegl_configs[num_cfgs].ui32DrawableType = WSEGL_DRAWABLE_WINDOW;
-				display->wsegl_configs[num_cfgs].ePixelFormat = WSEGL_PIXELFORMAT_ARGB8888;
-				display->wsegl_configs[num_cfgs].ulNativeVisualID = visual_iter.data->visual_id;
-				display->wsegl_configs[num_cfgs].ulNativeVisualType = visual_iter.data->_class;
-				display->wsegl_configs[num_cfgs].eTransparentType = WSEGL_OPAQUE;
+		*p = import->next;
+		break;
+	}
 
-				num_cfgs++;
+	import->next = NULL;
+	import->cached = false;
+}
 
-				break;
-			}
-#endif
-			if (depth_iter.data->depth == 24 &&
-			    (visual_iter.data->red_mask == 0x00FF0000) &&
-			    (visual_iter.data->green_mask == 0x0000FF00) &&
-			    (visual_iter.data->blue_mask == 0x000000FF)) {
+/*
+ * Remove a cached import that no longer matches its pixmap. Called with the
+ * display lock held.
+ */
+static void uncache_import(struct driws_display *display, struct driws_import *import)
+{
+	unlink_import(display, import);
 
-				display->wsegl_configs[num_cfgs].ui32DrawableType = WSEGL_DRAWABLE_WINDOW;
-				display->wsegl_configs[num_cfgs].ePixelFormat = WSEGL_PIXELFORMAT_XRGB8888;
-				display->wsegl_configs[num_cfgs].ulNativeVisualID = visual_iter.data->visual_id;
-				display->wsegl_configs[num_cfgs].ulNativeVisualType = visual_iter.data->_class;
-				display->wsegl_configs[num_cfgs].eTransparentType = WSEGL_OPAQUE;
+	if (import->refs)
+		return;
 
-				num_cfgs++;
+	display->num_idle_imports--;
+	destroy_import(import);
+}
 
-				// XXX BPP HACK
-				display->wsegl_configs[num_cfgs].ui32DrawableType = WSEGL_DRAWABLE_WINDOW;
+static struct driws_import *find_import(struct driws_display *display, xcb_pixmap_t pixmap)
+{
+	for (struct driws_import *i = display->imports; i; i = i->next)
+		if (i->pixmap == pixmap)
+			return i;
+
+	return NULL;
+}
+
+// Whether a cached import still has the pixmap's current geometry
+static bool import_matches(const struct driws_import *import, uint32_t width, uint32_t height, uint32_t depth)
+{
+	return import->width == width && import->height == height && import->depth == depth;
+}
+
+/*
+ * Take a reference to an import and make it the most recently used. Called
+ * with the display lock held.
+ */
+static void use_import(struct driws_display *display, struct driws_import *import)
+{
+	if (import->refs++ == 0 && import->cached)
+		display->num_idle_imports--;
+
+	unlink_import(display, import);
+	import->cached = true;
+	import->next = display->imports;
+	display->imports = import;
+}
+
+/*
+ * Find a cached import of the pixmap matching its geometry, dropping one
+ * that doesn't match. Called with the display lock held.
+ */
+static struct driws_import *find_matching_import(struct driws_display *display, xcb_pixmap_t pixmap,
+						 uint32_t width, uint32_t height, uint32_t depth)
+{
+	struct driws_import *import = find_import(display, pixmap);
+
+	if (import && !import_matches(import, width, height, depth)) {
+		DBG("pixmap 0x%x changed, dropping import", pixmap);
+		uncache_import(display, import);
+		import = NULL;
+	}
+
+	return import;
+}
+
+/*
+ * Return the import of a pixmap, from the cache if its geometry still
+ * matches. A pixmap freed and its XID reused for one of the same geometry
+ * can't be told apart.
+ */
+static struct driws_import *acquire_import(struct driws_display *display, xcb_pixmap_t pixmap)
+{
+	uint32_t width, height, depth;
+
+	if (!x_get_pixmap_geometry(display->xcb_connection, pixmap, &width, &height, &depth)) {
+		ERR("bad pixmap 0x%x", pixmap);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&display->lock);
+
+	struct driws_import *import = find_matching_import(display, pixmap, width, height, depth);
+
+	// The reference is taken before the lock is dropped, as an idle
+	// import may be evicted by other threads
+	if (import) {
+		use_import(display, import);
+		pthread_mutex_unlock(&display->lock);
+		return import;
+	}
+
+	pthread_mutex_unlock(&display->lock);
+
+	struct driws_import *new_import = import_pixmap(display, pixmap);
+	if (!new_import)
+		return NULL;
+
+	pthread_mutex_lock(&display->lock);
+
+	// Another thread may have imported the pixmap meanwhile
+	import = find_matching_import(display, pixmap, width, height, depth);
+
+	if (import)
+		destroy_import(new_import);
+	else
+		import = new_import;
+
+	use_import(display, import);
+
+	pthread_mutex_unlock(&display->lock);
+
+	return import;
+}
+
+/*
+ * Drop a reference to an import, keeping it cached for reuse. The least
+ * recently used idle imports are destroyed beyond the cache size. Called
+ * with the display lock held.
+ */
+static void release_import(struct driws_import *import)
+{
+	struct driws_display *display = import->display;
+
+	if (--import->refs)
+		return;
+
+	if (!import->cached) {
+		destroy_import(import);
+		return;
+	}
+
+	display->num_idle_imports++;
+
+	while (display->num_idle_imports > DRI3WS_IMPORT_CACHE_SIZE) {
+		struct driws_import *oldest = NULL;
+
+		for (struct driws_import *i = display->imports; i; i = i->next)
+			if (!i->refs)
+				oldest = i;
+
+		uncache_import(display, oldest);
+	}
+}
+
+static void destroy_imports(struct driws_display *display)
+{
+	while (display->imports) {
+		struct driws_import *import = display->imports;
+
+		if (import->refs)
+			ERR("pixmap 0x%x still in use", import->pixmap);
+
+		display->imports = import->next;
+		destroy_import(import);
+	}
+
+	display->num_idle_imports = 0;
+}
+
+/*
+ * Only windows covering the whole X screen are detected. On a multi-head
+ * setup a window fullscreen on one CRTC is smaller than the screen, and
+ * its buffers are not reallocated for scanout.
+ */
+static bool is_fullscreen(const struct driws_drawable *drawable)
+{
+	const xcb_screen_t *screen = drawable->display->xcb_screen;
+
+	return drawable->width == screen->width_in_pixels &&
+	       drawable->height == screen->height_in_pixels;
+}
+
+static bool create_buffers(struct driws_drawable *drawable)
+{
+	struct driws_display *display = drawable->display;
+	xcb_connection_t *c = display->xcb_connection;
+
+	//DBG("drawable %p", drawable);
+
+	uint32_t width, height;
+
+	drawable->round_trips++;
+	x_get_drawable_data(c, drawable->xcb_window, &width, &height);
+
+	if (drawable->buffers[0] && !drawable->scanout_pending) {
+		if (drawable->width == width && drawable->height == height)
+			return true;
+	}
+
+	drawable->scanout_pending = false;
+
+	DBG("Create new buffers %ux%u", width, height);
+
+	for (unsigned i = 0; i < ARRAY_SIZE(drawable->buffers); ++i) {
+		struct driws_buffer *buffer = drawable->buffers[i];
+
+		if (!buffer)
+			continue;
+
+		drawable->buffers[i] = NULL;
+
+		retire_buffer(buffer);
+	}
+
+	drawable->width = width;
+	drawable->height = height;
+
+	// Go back to regular buffers once the window is no longer fullscreen
+	if (drawable->scanout && !is_fullscreen(drawable)) {
+		drawable->scanout = false;
+		drawable->copy_frames = 0;
+	}
+
+	for (unsigned i = 0; i < drawable->num_buffers; ++i)
+		drawable->buffers[i] = acquire_buffer(drawable);
+
+	drawable->current_back_idx = 0;
+
+	DBG("new buffers allocated");
+
+	return true;
+}
+
+/*
+ * Add an idle buffer to the swapchain at idx, which is either the current
+ * back buffer's slot between frames, making it the next one rendered to, or
+ * the slot after it.
+ */
+static void grow_swapchain(struct driws_drawable *drawable, uint32_t idx)
+{
+	for (uint32_t i = drawable->num_buffers; i > idx; --i)
+		drawable->buffers[i] = drawable->buffers[i - 1];
+
+	drawable->buffers[idx] = acquire_buffer(drawable);
+	drawable->num_buffers++;
+
+	DBG("drawable=%p grown to %u buffers", drawable, drawable->num_buffers);
+}
+
+/*
+ * Remove the next back buffer from the swapchain
+ */
+static void shrink_swapchain(struct driws_drawable *drawable)
+{
+	uint32_t idx = drawable->current_back_idx;
+	struct driws_buffer *buffer = drawable->buffers[idx];
+
+	for (uint32_t i = idx; i < drawable->num_buffers - 1; ++i)
+		drawable->buffers[i] = drawable->buffers[i + 1];
+
+	drawable->num_buffers--;
+	drawable->buffers[drawable->num_buffers] = NULL;
+
+	if (drawable->current_back_idx == drawable->num_buffers)
+		drawable->current_back_idx = 0;
+
+	retire_buffer(buffer);
+
+	DBG("drawable=%p shrunk to %u buffers", drawable, drawable->num_buffers);
+}
+
+/*
+ * With swap interval 0 or in mailbox mode one buffer can be on screen and
+ * another queued for the next vblank while the client renders, so keep at
+ * least three.
+ */
+static uint32_t min_swapchain_depth(const struct driws_drawable *drawable)
+{
+	if (drawable->swap_interval == 0 ||
+	    drawable->present_mode == DRI3WS_PRESENT_MODE_MAILBOX)
+		return MAX(drawable->min_buffers, 3);
+
+	return drawable->min_buffers;
+}
+
+// Called with the display lock held
+static void ensure_min_swapchain_depth(struct driws_drawable *drawable)
+{
+	uint32_t min_depth = min_swapchain_depth(drawable);
+
+	if (drawable->num_buffers >= min_depth)
+		return;
+
+	if (!drawable->buffers[0]) {
+		drawable->num_buffers = min_depth;
+		return;
+	}
+
+	// The client may be rendering to the current back buffer, so add the
+	// new ones after it
+	while (drawable->num_buffers < min_depth)
+		grow_swapchain(drawable, drawable->current_back_idx + 1);
+}
+
+/*
+ * In mailbox mode buffers are not released in order, as a replaced present
+ * frees its buffer before older ones. Make the first idle buffer, starting
+ * from the current back buffer, the back buffer. Returns false if all are
+ * busy.
+ */
+static bool select_idle_back_buffer(struct driws_drawable *drawable)
+{
+	for (uint32_t i = 0; i < drawable->num_buffers; ++i) {
+		uint32_t idx = (drawable->current_back_idx + i) % drawable->num_buffers;
+
+		if (!buffer_is_busy(drawable->buffers[idx])) {
+			drawable->current_back_idx = idx;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Called once per frame. Grow the swapchain if rendering keeps waiting for
+ * the server to release buffers, and shrink it if there has been a spare
+ * idle buffer in every frame of the evaluation window.
+ */
+static void adapt_swapchain(struct driws_drawable *drawable)
+{
+	if (++drawable->adapt_frames < DRI3WS_ADAPT_FRAMES)
+		return;
+
+	if (drawable->adapt_blocked > DRI3WS_ADAPT_FRAMES / 4) {
+		if (drawable->num_buffers < drawable->max_buffers)
+			grow_swapchain(drawable, drawable->current_back_idx);
+	} else if (drawable->adapt_blocked == 0 && drawable->adapt_min_spare > 0) {
+		if (drawable->num_buffers > min_swapchain_depth(drawable))
+			shrink_swapchain(drawable);
+	}
+
+	drawable->adapt_frames = 0;
+	drawable->adapt_blocked = 0;
+	drawable->adapt_min_spare = UINT32_MAX;
+}
+
+__attribute__((unused))
+static const char *get_complete_mode_str(uint8_t mode)
+{
+	switch (mode) {
+	case XCB_PRESENT_COMPLETE_MODE_FLIP:
+		return "FLIP";
+	case XCB_PRESENT_COMPLETE_MODE_COPY:
+		return "COPY";
+	case XCB_PRESENT_COMPLETE_MODE_SKIP:
+		return "SKIP";
+	default:
+		return "UNKNOWN";
+	}
+}
+
+static void record_frame(struct driws_drawable *drawable, uint64_t sbc,
+			 const xcb_present_complete_notify_event_t *ce)
+{
+	struct driws_frame_ring *ring = &drawable->frame_ring;
+	const struct driws_present_info *info = &drawable->presents[sbc % DRI3WS_PRESENT_HISTORY];
+	struct dri3ws_frame_record *rec = &ring->records[ring->head % DRI3WS_FRAME_RING_SIZE];
+
+	rec->sbc = sbc;
+	rec->swap_ust = info->swap_ust;
+	rec->complete_ust = ce->ust;
+	rec->target_msc = info->target_msc;
+	rec->msc = ce->msc;
+	rec->mode = ce->mode;
+
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy the newest records from the ring, oldest first
+ */
+static unsigned read_frame_ring(const struct driws_frame_ring *ring, struct dri3ws_frame_record *records, unsigned max)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	unsigned count = MIN(max, MIN(head, DRI3WS_FRAME_RING_SIZE));
+	uint64_t first = head - count;
+
+	for (unsigned i = 0; i < count; ++i)
+		records[i] = ring->records[(first + i) % DRI3WS_FRAME_RING_SIZE];
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	// Drop the records the writer has overwritten or is writing meanwhile
+	uint64_t valid = __atomic_load_n(&ring->head, __ATOMIC_RELAXED) + 1;
+
+	if (valid > DRI3WS_FRAME_RING_SIZE && valid - DRI3WS_FRAME_RING_SIZE > first) {
+		unsigned stale = MIN(count, valid - DRI3WS_FRAME_RING_SIZE - first);
+
+		memmove(records, records + stale, (count - stale) * sizeof(*records));
+		count -= stale;
+	}
+
+	return count;
+}
+
+static void compute_frame_stats(const struct dri3ws_frame_record *records, unsigned count,
+				struct dri3ws_frame_stats *stats)
+{
+	uint64_t latency_sum = 0;
+	uint32_t latency_count = 0;
+	const struct dri3ws_frame_record *prev_shown = NULL;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (unsigned i = 0; i < count; ++i) {
+		const struct dri3ws_frame_record *rec = &records[i];
+
+		stats->frames++;
+
+		switch (rec->mode) {
+		case XCB_PRESENT_COMPLETE_MODE_FLIP:
+			stats->flips++;
+			break;
+		case XCB_PRESENT_COMPLETE_MODE_COPY:
+			stats->copies++;
+			break;
+		case XCB_PRESENT_COMPLETE_MODE_SKIP:
+			stats->skips++;
+			break;
+		}
+
+		if (rec->swap_ust && rec->complete_ust >= rec->swap_ust) {
+			uint64_t latency = rec->complete_ust - rec->swap_ust;
+
+			latency_sum += latency;
+			latency_count++;
+			stats->latency_max_us = MAX(stats->latency_max_us, latency);
+		}
+
+		// Skipped frames were never on screen
+		if (rec->mode == XCB_PRESENT_COMPLETE_MODE_SKIP)
+			continue;
+
+		if (rec->target_msc && rec->msc > rec->target_msc)
+			stats->late_frames++;
+
+		if (prev_shown) {
+			uint64_t interval = rec->msc - prev_shown->msc;
+
+			stats->interval_histogram[MIN(interval, DRI3WS_FRAME_HISTOGRAM_SIZE - 1)]++;
+		}
+
+		prev_shown = rec;
+	}
+
+	if (latency_count)
+		stats->latency_avg_us = latency_sum / latency_count;
+}
+
+static void print_frame_stats(struct driws_drawable *drawable)
+{
+	struct dri3ws_frame_record *records;
+	struct dri3ws_frame_stats stats;
+
+	records = malloc(DRI3WS_FRAME_RING_SIZE * sizeof(*records));
+	if (!records)
+		return;
+
+	unsigned count = read_frame_ring(&drawable->frame_ring, records, DRI3WS_FRAME_RING_SIZE);
+	compute_frame_stats(records, count, &stats);
+
+	free(records);
+
+	printf("DRI3WS drawable 0x%x: last %u frames: %u flips, %u copies, %u skips, %u late, "
+	       "latency avg %llu us, max %llu us\n",
+	       drawable->xcb_window, stats.frames, stats.flips, stats.copies, stats.skips,
+	       stats.late_frames,
+	       (unsigned long long)stats.latency_avg_us, (unsigned long long)stats.latency_max_us);
+
+	printf("DRI3WS drawable 0x%x: vblanks between frames:", drawable->xcb_window);
+	for (unsigned i = 0; i < DRI3WS_FRAME_HISTOGRAM_SIZE; ++i)
+		printf(" %u%s:%u", i, i == DRI3WS_FRAME_HISTOGRAM_SIZE - 1 ? "+" : "",
+		       stats.interval_histogram[i]);
+	printf("\n");
+}
+
+/*
+ * A fullscreen window is normally flipped. If it keeps being copied, the
+ * buffers are likely not usable for scanout, so ask for new buffers
+ * allocated for it.
+ */
+static void check_complete_mode(struct driws_drawable *drawable, uint8_t mode)
+{
+	drawable->complete_mode = mode;
+
+	if (mode != XCB_PRESENT_COMPLETE_MODE_COPY) {
+		if (mode == XCB_PRESENT_COMPLETE_MODE_FLIP)
+			drawable->copy_frames = 0;
+		return;
+	}
+
+	if (++drawable->copy_frames != DRI3WS_SCANOUT_COPY_FRAMES)
+		return;
+
+	if (!is_fullscreen(drawable) || !drawable->display->scanout_pitch_align)
+		return;
+
+	const struct driws_buffer *buffer = drawable->buffers[drawable->current_back_idx];
+
+	if (drawable->scanout) {
+		ERR("drawable 0x%x: fullscreen presents are copied with scanout buffers, "
+		    "flipping is disabled by the X server or a compositor", drawable->xcb_window);
+		return;
+	}
+
+	ERR("drawable 0x%x: fullscreen presents are copied (%ux%u, stride %u), "
+	    "reallocating buffers for scanout", drawable->xcb_window,
+	    drawable->width, drawable->height, buffer ? buffer->stride_bytes : 0);
+
+	drawable->scanout = true;
+	drawable->scanout_pending = true;
+}
+
+/*
+ * Least squares fit of UST against MSC over the recent samples. Relative
+ * values keep the sums small enough for doubles.
+ */
+static void update_vblank_model(struct driws_vblank_model *m, uint64_t msc, uint64_t ust)
+{
+	if (m->count) {
+		uint64_t last = m->msc[(m->head + DRI3WS_VBLANK_SAMPLES - 1) % DRI3WS_VBLANK_SAMPLES];
+
+		if (last == msc)
+			return;
+
+		// The MSC went backwards, start over
+		if (last > msc) {
+			m->count = 0;
+			m->head = 0;
+		}
+	}
+
+	m->msc[m->head] = msc;
+	m->ust[m->head] = ust;
+	m->head = (m->head + 1) % DRI3WS_VBLANK_SAMPLES;
+	m->count = MIN(m->count + 1, DRI3WS_VBLANK_SAMPLES);
+
+	if (m->count < 2)
+		return;
+
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+	for (uint32_t i = 0; i < m->count; ++i) {
+		double x = (double)(int64_t)(m->msc[i] - msc);
+		double y = (double)(int64_t)(m->ust[i] - ust);
+
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+
+	double n = m->count;
+	double period = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+
+	// Ignore fits far from any real refresh rate
+	if (!(period > 4000 && period < 100000))
+		return;
+
+	m->period_us = period;
+	m->ref_msc = msc;
+	m->ref_ust = ust + (int64_t)((sy - period * sx) / n);
+	m->valid = true;
+}
+
+static void update_render_time(struct driws_drawable *drawable, uint64_t end_us)
+{
+	if (!drawable->frame_start_us)
+		return;
+
+	int64_t sample = end_us - drawable->frame_start_us;
+	int64_t err = sample - (int64_t)drawable->render_avg_us;
+
+	drawable->frame_start_us = 0;
+
+	if (!drawable->render_avg_us) {
+		drawable->render_avg_us = sample;
+		drawable->render_dev_us = sample / 2;
+		return;
+	}
+
+	drawable->render_avg_us += err / 8;
+	drawable->render_dev_us += ((err < 0 ? -err : err) - (int64_t)drawable->render_dev_us) / 4;
+}
+
+/*
+ * A present replaced by a newer one, as in mailbox mode or with swap
+ * interval 0, is reported as skipped. Only a present with a newer one
+ * already sent can have been replaced, and if both had a target vblank,
+ * it must be the same. Without targets, skips of a covered window can't be
+ * told apart from replacements while frames are queued behind it.
+ */
+static bool present_superseded(const struct driws_drawable *drawable, uint64_t sbc)
+{
+	if (sbc >= drawable->send_sbc)
+		return false;
+
+	if (drawable->send_sbc - sbc >= DRI3WS_PRESENT_HISTORY)
+		return true;
+
+	const struct driws_present_info *info = &drawable->presents[sbc % DRI3WS_PRESENT_HISTORY];
+	const struct driws_present_info *next = &drawable->presents[(sbc + 1) % DRI3WS_PRESENT_HISTORY];
+
+	return !info->target_msc || next->target_msc == info->target_msc;
+}
+
+/*
+ * Count skips of presents the server did not replace. An unmapped window
+ * isn't necessarily skipped, Xorg reports its presents as copies, so the
+ * map state is checked at the next swap too.
+ */
+static void check_visibility(struct driws_drawable *drawable, uint64_t sbc,
+			     const xcb_present_complete_notify_event_t *ce)
+{
+	if (!drawable->hidden_throttle)
+		return;
+
+	if (ce->mode != XCB_PRESENT_COMPLETE_MODE_SKIP) {
+		drawable->skip_frames = 0;
+		drawable->hidden = false;
+		return;
+	}
+
+	if (present_superseded(drawable, sbc))
+		return;
+
+	if (drawable->skip_frames == 0)
+		__atomic_store_n(&drawable->check_mapped, true, __ATOMIC_RELEASE);
+
+	if (++drawable->skip_frames == DRI3WS_HIDDEN_SKIP_FRAMES) {
+		DBG("drawable=%p hidden", drawable);
+		drawable->hidden = true;
+	}
+}
+
+static void handle_special_event(struct driws_drawable *drawable, xcb_present_generic_event_t *ge)
+{
+	switch (ge->evtype) {
+	case XCB_PRESENT_COMPLETE_NOTIFY: {
+		xcb_present_complete_notify_event_t *ce = (xcb_present_complete_notify_event_t*) ge;
+
+		DBG("XCB_PRESENT_COMPLETE_NOTIFY %u, %s, msc %llu, ust %llu", ce->serial,
+		    get_complete_mode_str(ce->mode),
+		    (unsigned long long)ce->msc, (unsigned long long)ce->ust);
+
+		if (ce->kind != XCB_PRESENT_COMPLETE_KIND_PIXMAP)
+			break;
+
+		// The serial is the low 32 bits of the SBC
+		uint64_t sbc = drawable->send_sbc - (uint32_t)((uint32_t)drawable->send_sbc - ce->serial);
+
+		// A later present that failed may have been counted already
+		drawable->recv_sbc = MAX(drawable->recv_sbc, sbc);
+		drawable->msc = ce->msc;
+
+		record_frame(drawable, sbc, ce);
+		check_complete_mode(drawable, ce->mode);
+		check_visibility(drawable, sbc, ce);
+
+		if (ce->mode != XCB_PRESENT_COMPLETE_MODE_SKIP && ce->ust)
+			update_vblank_model(&drawable->vblank, ce->msc, ce->ust);
+
+		break;
+	}
+
+	case XCB_PRESENT_EVENT_IDLE_NOTIFY: {
+		xcb_present_idle_notify_event_t *ie = (xcb_present_idle_notify_event_t*) ge;
+
+		DBG("XCB_PRESENT_EVENT_IDLE_NOTIFY %u", ie->serial);
+
+		/*
+		 * The pixmap is normally found in the drawable's swapchain.
+		 * Fall back to the index for buffers replaced since, e.g. on
+		 * resize.
+		 */
+		struct driws_buffer *buffer = NULL;
+
+		if (ie->window == drawable->xcb_window) {
+			for (unsigned i = 0; i < drawable->num_buffers; ++i) {
+				if (drawable->buffers[i] && drawable->buffers[i]->x_pixmap == ie->pixmap) {
+					buffer = drawable->buffers[i];
+					break;
+				}
+			}
+		}
+
+		if (!buffer)
+			buffer = find_buffer_from_list(drawable->display, ie->pixmap);
+
+		if (buffer)
+			idle_buffer(buffer);
+
+		break;
+	}
+
+	case XCB_PRESENT_EVENT_CONFIGURE_NOTIFY: {
+		__attribute__((unused))
+		xcb_present_configure_notify_event_t *ce = (xcb_present_configure_notify_event_t*) ge;
+		DBG("XCB_PRESENT_EVENT_CONFIGURE_NOTIFY %ux%u", ce->width, ce->height);
+		drawable->size_changed = true;
+		break;
+	}
+
+	case XCB_PRESENT_EVENT_REDIRECT_NOTIFY: {
+		__attribute__((unused))
+		xcb_present_redirect_notify_event_t *re = (xcb_present_redirect_notify_event_t*) ge;
+		DBG("XCB_PRESENT_EVENT_REDIRECT_NOTIFY %u", re->serial);
+
+		break;
+	}
+
+	}
+	free(ge);
+}
+
+/*
+ * Handle the drawable's queued events. Returns true if there were any.
+ * Called with the display lock held.
+ */
+static bool poll_special_events(struct driws_drawable *drawable)
+{
+	struct xcb_connection_t *c = drawable->display->xcb_connection;
+	xcb_generic_event_t *ev;
+	bool handled = false;
+
+	while ((ev = xcb_poll_for_special_event(c, drawable->special_ev)) != NULL) {
+		xcb_present_generic_event_t *ge = (void *)ev;
+		handle_special_event(drawable, ge);
+		handled = true;
+	}
+
+	return handled;
+}
+
+/*
+ * Called with the display lock held, which is dropped while blocking
+ */
+static void wait_special_event(struct driws_drawable *drawable)
+{
+	struct driws_display *display = drawable->display;
+	struct xcb_connection_t *c = display->xcb_connection;
+	xcb_generic_event_t *ev;
+
+	pthread_mutex_unlock(&display->lock);
+	ev = xcb_wait_for_special_event(c, drawable->special_ev);
+	pthread_mutex_lock(&display->lock);
+
+	handle_special_event(drawable, (xcb_present_generic_event_t*)ev);
+
+	poll_special_events(drawable);
+}
+
+static void *event_thread_main(void *data)
+{
+	struct driws_display *display = data;
+	struct driws_event_thread *et = &display->event_thread;
+
+	struct pollfd fds[2] = {
+		{ .fd = xcb_get_file_descriptor(display->xcb_connection), .events = POLLIN },
+		{ .fd = et->wake_fd, .events = POLLIN },
+	};
+
+	int timeout = DRI3WS_EVENT_POLL_MS;
+
+	pthread_mutex_lock(&display->lock);
+
+	while (!et->quit) {
+		bool handled = false;
+		bool outstanding = false;
+
+		for (struct driws_drawable *d = display->drawables; d; d = d->next) {
+			handled |= poll_special_events(d);
+			outstanding |= d->send_sbc != d->recv_sbc;
+		}
+
+		if (handled)
+			pthread_cond_broadcast(&display->event_cond);
+
+		pthread_mutex_unlock(&display->lock);
+
+		/*
+		 * Back off while wakeups find nothing. If the connection was readable
+		 * without yielding our events, someone else is reading it, so stop
+		 * polling it until the timeout rather than spinning. With no presents
+		 * outstanding there is nothing to time out on, and waiters kick the
+		 * eventfd.
+		 */
+		bool spurious = !handled && (fds[0].revents & POLLIN);
+
+		if (handled)
+			timeout = DRI3WS_EVENT_POLL_MS;
+		else
+			timeout = MIN(timeout * 2, DRI3WS_EVENT_POLL_MAX_MS);
+
+		fds[0].events = spurious ? 0 : POLLIN;
+
+		poll(fds, ARRAY_SIZE(fds), outstanding || spurious ? timeout : -1);
+
+		if (fds[1].revents & POLLIN) {
+			uint64_t val;
+			if (read(et->wake_fd, &val, sizeof(val)) < 0)
+				ERR("failed to read event thread eventfd");
+		}
+
+		pthread_mutex_lock(&display->lock);
+	}
+
+	pthread_mutex_unlock(&display->lock);
+
+	return NULL;
+}
+
+static void wake_event_thread(struct driws_display *display)
+{
+	uint64_t val = 1;
+
+	if (write(display->event_thread.wake_fd, &val, sizeof(val)) < 0)
+		ERR("failed to wake event thread");
+}
+
+static void start_event_thread(struct driws_display *display)
+{
+	struct driws_event_thread *et = &display->event_thread;
+
+	et->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	FAIL_IF(et->wake_fd < 0, "failed to create eventfd");
+
+	int r = pthread_create(&et->thread, NULL, event_thread_main, display);
+	FAIL_IF(r, "failed to create event thread");
+
+	et->running = true;
+}
+
+static void stop_event_thread(struct driws_display *display)
+{
+	struct driws_event_thread *et = &display->event_thread;
+
+	if (!et->running)
+		return;
+
+	pthread_mutex_lock(&display->lock);
+	et->quit = true;
+	pthread_mutex_unlock(&display->lock);
+
+	wake_event_thread(display);
+
+	pthread_join(et->thread, NULL);
+	close(et->wake_fd);
+
+	et->running = false;
+}
+
+/*
+ * Wait until events for the drawable have been handled, either by the
+ * event thread or by ourselves. Called with the display lock held.
+ */
+static void wait_for_events(struct driws_drawable *drawable)
+{
+	struct driws_display *display = drawable->display;
+
+	if (!display->event_thread.running) {
+		wait_special_event(drawable);
+		return;
+	}
+
+	wake_event_thread(display);
+	pthread_cond_wait(&display->event_cond, &display->lock);
+}
+
+/*
+ * Collect the results of earlier present requests. Only requests the X
+ * server has already processed are looked at, unless wait is set, in which
+ * case the oldest one is waited for. Returns false if a present failed.
+ */
+static bool check_present_requests(struct driws_drawable *drawable, bool wait)
+{
+	struct driws_display *display = drawable->display;
+	xcb_connection_t *c = display->xcb_connection;
+	bool ok = true;
+
+	while (drawable->pending_count) {
+		struct driws_present_request *req = &drawable->pending_presents[drawable->pending_head];
+		xcb_generic_error_t *error = NULL;
+
+		if (wait) {
+			xcb_void_cookie_t cookie = { req->sequence };
+
+			drawable->round_trips++;
+			error = xcb_request_check(c, cookie);
+			wait = false;
+		} else {
+			void *reply = NULL;
+
+			if (!xcb_poll_for_reply(c, req->sequence, &reply, &error))
+				break;
+
+			free(reply);
+		}
+
+		if (error) {
+			ERR("present pixmap failed: error %u", error->error_code);
+			free(error);
+
+			// No IdleNotify will come for this pixmap
+			struct driws_buffer *buffer = find_buffer_from_list(display, req->pixmap);
+			if (buffer)
+				idle_buffer(buffer);
+
+			// Nor a CompleteNotify, so stop counting it in flight
+			drawable->recv_sbc = MAX(drawable->recv_sbc, req->sbc);
+
+			ok = false;
+		}
+
+		drawable->pending_head = (drawable->pending_head + 1) % DRI3WS_MAX_PENDING_PRESENTS;
+		drawable->pending_count--;
+	}
+
+	return ok;
+}
+
+static bool has_pending_present(const struct driws_drawable *drawable, xcb_pixmap_t pixmap)
+{
+	for (uint32_t i = 0; i < drawable->pending_count; ++i) {
+		uint32_t idx = (drawable->pending_head + i) % DRI3WS_MAX_PENDING_PRESENTS;
+
+		if (drawable->pending_presents[idx].pixmap == pixmap)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Wait until the presents of a pixmap are known to have succeeded or
+ * failed. A failed present never releases its pixmap, so this must be done
+ * before waiting for it to become idle.
+ */
+static bool check_pixmap_presents(struct driws_drawable *drawable, xcb_pixmap_t pixmap)
+{
+	bool ok = true;
+
+	while (has_pending_present(drawable, pixmap))
+		ok &= check_present_requests(drawable, true);
+
+	return ok;
+}
+
+static void discard_present_requests(struct driws_drawable *drawable)
+{
+	xcb_connection_t *c = drawable->display->xcb_connection;
+
+	while (drawable->pending_count) {
+		xcb_discard_reply(c, drawable->pending_presents[drawable->pending_head].sequence);
+
+		drawable->pending_head = (drawable->pending_head + 1) % DRI3WS_MAX_PENDING_PRESENTS;
+		drawable->pending_count--;
+	}
+}
+
+static struct driws_drawable *find_drawable(struct driws_display *display, xcb_drawable_t xid)
+{
+	for (struct driws_drawable *d = display->drawables; d; d = d->next) {
+		if (d->xcb_window == xid)
+			return d;
+	}
+
+	return NULL;
+}
+
+static WSEGLError WSEGL_IsDisplayValid(NativeDisplayType hNativeDisplay)
+{
+	Display *dpy = (Display*)hNativeDisplay;
+
+	DBG("native %p", dpy);
+
+	if (dpy == NULL)
+		return WSEGL_BAD_NATIVE_DISPLAY;
+
+	xcb_connection_t *c = XGetXCBConnection(dpy);
+	if (!c)
+		return WSEGL_BAD_NATIVE_DISPLAY;
+
+	return WSEGL_SUCCESS;
+}
+
+struct driws_services_init {
+	struct pvr_data *pvr_data;
+	uint64_t time_us;
+};
+
+static void *services_init_main(void *data)
+{
+	struct driws_services_init *init = data;
+	uint64_t start = get_time_us();
+
+	init->pvr_data = AcquireServices();
+	init->time_us = get_time_us() - start;
+
+	return NULL;
+}
+
+static const WSEGLCaps *get_caps(void)
+{
+	return env_uint("DRI3WS_EGL_LOCK", 0) ? s_driws_caps_locked : s_driws_caps;
+}
+
+static WSEGLError WSEGL_InitialiseDisplay(NativeDisplayType hNativeDisplay,
+					  WSEGLDisplayHandle *phDisplay,
+					  const WSEGLCaps **psCapabilities,
+					  WSEGLConfig **psConfigs)
+{
+	Display *dpy = hNativeDisplay;
+
+	DBG("native %p", hNativeDisplay);
+
+	// Held throughout, so that a display is only initialised once
+	pthread_mutex_lock(&s_displays_lock);
+
+	for (struct driws_display *d = s_displays; d; d = d->next)
+	{
+		if (d->xdisplay != dpy)
+			continue;
+
+		d->ref_count++;
+
+		*phDisplay = (WSEGLDisplayHandle)d;
+		*psCapabilities = get_caps();
+		*psConfigs = d->wsegl_configs;
+
+		pthread_mutex_unlock(&s_displays_lock);
+
+		return WSEGL_SUCCESS;
+	}
+
+	uint64_t start_us = get_time_us();
+
+	struct driws_display *display = calloc(1, sizeof(*display));
+
+	// Connect to PVR services while talking to the X server
+	struct driws_services_init services_init = { 0 };
+	pthread_t services_thread;
+
+	int r = pthread_create(&services_thread, NULL, services_init_main, &services_init);
+	FAIL_IF(r, "failed to create services thread");
+
+	xcb_connection_t *c = XGetXCBConnection(dpy);
+	FAIL_IF(!c, "XGetXCBConnection failed");
+
+	const xcb_setup_t *setup = xcb_get_setup(c);
+	FAIL_IF(!setup, "xcb_get_setup failed");
+
+	/* get the first screen */
+	xcb_screen_t *screen = xcb_setup_roots_iterator(setup).data;
+	FAIL_IF(!screen, "failed to find screen");
+
+	struct x_init_requests x_requests;
+
+	x_init_send(c, screen, &x_requests);
+
+	uint64_t x_sent_us = get_time_us();
+
+	int drm_fd = x_init_receive(c, &x_requests);
+	FAIL_IF(drm_fd < 0, "drm fd failed");
+
+	bool has_xfixes = x_requests.has_xfixes;
+
+	uint64_t x_done_us = get_time_us();
+
+	unsigned num_cfgs = 0;
+
+	for (xcb_depth_iterator_t depth_iter = xcb_screen_allowed_depths_iterator(screen);
+	     depth_iter.rem;
+	     xcb_depth_next(&depth_iter)) {
+
+		for (xcb_visualtype_iterator_t visual_iter = xcb_depth_visuals_iterator(depth_iter.data);
+		     visual_iter.rem;
+		     xcb_visualtype_next(&visual_iter)) {
+#if 0
+			// XXX BPP HACK
+
+			if (depth_iter.data->depth == 32 &&
+			    (visual_iter.data->red_mask == 0x00FF0000) &&
+			    (visual_iter.data->green_mask == 0x0000FF00) &&
+			    (visual_iter.data->blue_mask == 0x000000FF)) {
+
+				display->wsegl_configs[num_cfgs].ui32DrawableType = WSEGL_DRAWABLE_WINDOW | WSEGL_DRAWABLE_PIXMAP;
+				display->wsegl_configs[num_cfgs].ePixelFormat = WSEGL_PIXELFORMAT_ARGB8888;
+				display->wsegl_configs[num_cfgs].ulNativeVisualID = visual_iter.data->visual_id;
+				display->wsegl_configs[num_cfgs].ulNativeVisualType = visual_iter.data->_class;
+				display->wsegl_configs[num_cfgs].eTransparentType = WSEGL_OPAQUE;
+
+				num_cfgs++;
+
+				break;
+			}
+#endif
+			if (depth_iter.data->depth == 24 &&
+			    (visual_iter.data->red_mask == 0x00FF0000) &&
+			    (visual_iter.data->green_mask == 0x0000FF00) &&
+			    (visual_iter.data->blue_mask == 0x000000FF)) {
+
+				display->wsegl_configs[num_cfgs].ui32DrawableType = WSEGL_DRAWABLE_WINDOW | WSEGL_DRAWABLE_PIXMAP;
+				display->wsegl_configs[num_cfgs].ePixelFormat = WSEGL_PIXELFORMAT_XRGB8888;
+				display->wsegl_configs[num_cfgs].ulNativeVisualID = visual_iter.data->visual_id;
+				display->wsegl_configs[num_cfgs].ulNativeVisualType = visual_iter.data->_class;
+				display->wsegl_configs[num_cfgs].eTransparentType = WSEGL_OPAQUE;
+
+				num_cfgs++;
+
+				// XXX BPP HACK
+				display->wsegl_configs[num_cfgs].ui32DrawableType = WSEGL_DRAWABLE_WINDOW | WSEGL_DRAWABLE_PIXMAP;
 				display->wsegl_configs[num_cfgs].ePixelFormat = WSEGL_PIXELFORMAT_ARGB8888;
 				display->wsegl_configs[num_cfgs].ulNativeVisualID = visual_iter.data->visual_id;
 				display->wsegl_configs[num_cfgs].ulNativeVisualType = visual_iter.data->_class;
 				display->wsegl_configs[num_cfgs].eTransparentType = WSEGL_OPAQUE;
 
-				num_cfgs++;
-				break;
-			}
+				num_cfgs++;
+				break;
+			}
+
+			if (depth_iter.data->depth == 16 &&
+			    (visual_iter.data->red_mask == 0xF800) &&
+			    (visual_iter.data->green_mask == 0x07E0) &&
+			    (visual_iter.data->blue_mask == 0x001F)) {
+
+				display->wsegl_configs[num_cfgs].ui32DrawableType = WSEGL_DRAWABLE_WINDOW | WSEGL_DRAWABLE_PIXMAP;
+				display->wsegl_configs[num_cfgs].ePixelFormat = WSEGL_PIXELFORMAT_RGB565;
+				display->wsegl_configs[num_cfgs].ulNativeVisualID = visual_iter.data->visual_id;
+				display->wsegl_configs[num_cfgs].ulNativeVisualType = visual_iter.data->_class;
+				display->wsegl_configs[num_cfgs].eTransparentType = WSEGL_OPAQUE;
+
+				num_cfgs++;
+
+				break;
+			}
+		}
+	}
+
+	display->wsegl_configs[num_cfgs].ui32DrawableType = WSEGL_NO_DRAWABLE;
+
+	uint64_t join_us = get_time_us();
+
+	pthread_join(services_thread, NULL);
+
+	if (!services_init.pvr_data) {
+		//error = WSEGL_CANNOT_INITIALISE;
+		FAIL("InitialiseServices failed");
+	}
+
+	display->pvr_data = services_init.pvr_data;
+
+	uint64_t services_done_us = get_time_us();
+
+	// Keep a copy of the native display
+	display->xdisplay = dpy;
+	display->xcb_connection = c;
+	display->xcb_screen = screen;
+
+	// Initialise the ref count
+	display->ref_count = 1;
+
+	// Save the DRM file descriptor.
+	display->drm_fd = drm_fd;
+
+	display->pool.max_count = env_uint("DRI3WS_POOL_SIZE", DRI3WS_DEFAULT_POOL_SIZE);
+	display->has_xfixes = has_xfixes;
+	display->gpu_wait_timeout_us = env_uint("DRI3WS_GPU_WAIT_TIMEOUT_MS", 0) * 1000ull;
+	display->gpu_spin_us = env_uint("DRI3WS_GPU_SPIN_US", 0);
+	display->vblank_margin_us = env_uint("DRI3WS_VBLANK_MARGIN_US", DRI3WS_DEFAULT_VBLANK_MARGIN_US);
+	// The pitch must stay a whole number of pixels in every format
+	display->scanout_pitch_align = round_up_to(env_uint("DRI3WS_SCANOUT_ALIGN",
+							    DRI3WS_DEFAULT_SCANOUT_PITCH_ALIGN), 4);
+	display->copy_cpu = env_uint("DRI3WS_COPY_CPU", 0);
+
+	pthread_mutex_init(&display->lock, NULL);
+	pthread_cond_init(&display->event_cond, NULL);
+
+	if (env_uint("DRI3WS_EVENT_THREAD", 0))
+		start_event_thread(display);
+
+#ifdef DRI3WS_USE_GBM
+	struct gbm_device* gbm = gbm_create_device(drm_fd);
+	FAIL_IF(!gbm, "no gbm");
+
+	display->gbm = gbm;
+#endif
+	if (!s_displays) {
+		s_displays = display;
+	} else {
+		struct driws_display *d = s_displays;
+		while (d->next)
+			d = d->next;
+		d->next = display;
+	}
+
+	if (env_uint("DRI3WS_STATS", 0)) {
+		uint64_t end_us = get_time_us();
+
+		printf("DRI3WS init: %llu us total; X extensions %llu us, X replies %llu us, "
+		       "PVR services %llu us in parallel, waited %llu us for them\n",
+		       (unsigned long long)(end_us - start_us),
+		       (unsigned long long)(x_sent_us - start_us),
+		       (unsigned long long)(x_done_us - x_sent_us),
+		       (unsigned long long)services_init.time_us,
+		       (unsigned long long)(services_done_us - join_us));
+	}
+
+	pthread_mutex_unlock(&s_displays_lock);
+
+	// Return the address of the caps + configs structures
+	*psCapabilities = get_caps();
+	*psConfigs = display->wsegl_configs;
+	*phDisplay = (WSEGLDisplayHandle)display;
+
+	DBG("Done, phDisplay %p", phDisplay);
+
+	return WSEGL_SUCCESS;
+
+	// XXX cleanup
+}
+
+static WSEGLError WSEGL_CloseDisplay(WSEGLDisplayHandle hDisplay)
+{
+	struct driws_display *display = (struct driws_display*)hDisplay;
+
+	DBG("display=%p", display);
+
+	pthread_mutex_lock(&s_displays_lock);
+
+	// Only close displays with a ref count of 0
+	display->ref_count--;
+	if (display->ref_count) {
+		pthread_mutex_unlock(&s_displays_lock);
+		return WSEGL_SUCCESS;
+	}
+
+	for (struct driws_display *d = s_displays, *prev = NULL; d; prev = d, d = d->next)
+	{
+		if (d != display)
+			continue;
+
+		if (prev)
+			prev->next = display->next;
+		else
+			s_displays = display->next;
+
+		break;
+	}
+
+	pthread_mutex_unlock(&s_displays_lock);
+
+	// Wait for dri3ws_* calls that found the display before it was unlinked
+	pthread_mutex_lock(&display->lock);
+	pthread_mutex_unlock(&display->lock);
+
+	if (env_uint("DRI3WS_STATS", 0))
+		printf("DRI3WS pool: %llu hits, %llu misses, %llu evictions, %u/%u buffers\n",
+		       (unsigned long long)display->pool.hits,
+		       (unsigned long long)display->pool.misses,
+		       (unsigned long long)display->pool.evictions,
+		       display->pool.count, display->pool.max_count);
+
+	stop_event_thread(display);
+
+	destroy_retired_buffers(display, NULL);
+	drain_pool(display);
+	destroy_imports(display);
+
+	StopCompletionService(&display->completions);
+
+	pthread_cond_destroy(&display->event_cond);
+	pthread_mutex_destroy(&display->lock);
+
+#ifdef DRI3WS_USE_GBM
+	gbm_device_destroy(display->gbm);
+#endif
+	close(display->drm_fd);
+
+	ReleaseServices(display->pvr_data);
+
+	free(display);
+
+	return WSEGL_SUCCESS;
+}
+
+static WSEGLError WSEGL_CreateWindowDrawable(WSEGLDisplayHandle hDisplay,
+					     WSEGLConfig *psConfig,
+					     WSEGLDrawableHandle *phDrawable,
+					     NativeWindowType hNativeWindow,
+					     WSEGLRotationAngle *eRotationAngle)
+{
+	struct driws_display *display = (struct driws_display*)hDisplay;
+
+	DBG("display=%p, native=%lx, format %s", hDisplay, hNativeWindow, format2str(psConfig->ePixelFormat));
+
+	if (!psConfig || !(psConfig->ui32DrawableType & WSEGL_DRAWABLE_WINDOW))
+		return WSEGL_BAD_MATCH;
+
+	struct driws_drawable *drawable = calloc(1, sizeof(struct driws_drawable));
+	if (!drawable)
+		return WSEGL_OUT_OF_MEMORY;
+
+	DBG("  allocated drawable=%p", drawable);
+
+	drawable->drawable_type = DRI3WS_DRAWABLE_WINDOW;
+	drawable->display = display;
+	drawable->xcb_window = hNativeWindow;
+	drawable->wsegl_pixel_format = psConfig->ePixelFormat;
+
+	drawable->min_buffers = env_uint("DRI3WS_BUFFERS_MIN", DRI3WS_MIN_BUFFERS);
+	drawable->max_buffers = env_uint("DRI3WS_BUFFERS_MAX", DRI3WS_DEFAULT_MAX_BUFFERS);
+	drawable->num_buffers = env_uint("DRI3WS_BUFFERS", DRI3WS_DEFAULT_BUFFERS);
+	drawable->adaptive = env_uint("DRI3WS_ADAPTIVE_BUFFERS", 0);
+	drawable->swap_interval = 1;
+	drawable->hidden_throttle = env_uint("DRI3WS_HIDDEN_THROTTLE", 0);
+	drawable->hidden_fps = env_uint("DRI3WS_HIDDEN_FPS", DRI3WS_DEFAULT_HIDDEN_FPS);
+	drawable->max_frames_in_flight = MIN(env_uint("DRI3WS_MAX_FRAMES_IN_FLIGHT", 0), DRI3WS_MAX_BUFFERS);
+	drawable->present_mode = env_uint("DRI3WS_PRESENT_MODE", DRI3WS_PRESENT_MODE_FIFO) ?
+		DRI3WS_PRESENT_MODE_MAILBOX : DRI3WS_PRESENT_MODE_FIFO;
+	drawable->adapt_min_spare = UINT32_MAX;
+
+	drawable->min_buffers = CLAMP(drawable->min_buffers, DRI3WS_MIN_BUFFERS, DRI3WS_MAX_BUFFERS);
+	drawable->max_buffers = CLAMP(drawable->max_buffers, drawable->min_buffers, DRI3WS_MAX_BUFFERS);
+
+	if (drawable->adaptive)
+		drawable->num_buffers = CLAMP(drawable->num_buffers, drawable->min_buffers, drawable->max_buffers);
+	else
+		drawable->num_buffers = CLAMP(drawable->num_buffers, DRI3WS_MIN_BUFFERS, DRI3WS_MAX_BUFFERS);
+
+	drawable->num_buffers = MAX(drawable->num_buffers, min_swapchain_depth(drawable));
+
+	*phDrawable = (WSEGLDrawableHandle)drawable;
+
+	*eRotationAngle = WSEGL_ROTATE_0;
+
+	pthread_mutex_lock(&display->lock);
+
+	if (env_uint("DRI3WS_IDLE_FENCE", 1)) {
+		if (!display->shm_fence_checked) {
+			display->shm_fence_supported = x_check_shm_fence(display->xcb_connection,
+									 display->xcb_screen->root);
+			display->shm_fence_checked = true;
+		}
+
+		drawable->use_idle_fence = display->shm_fence_supported;
+	}
+
+	uint32_t event_mask = XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY |
+			      XCB_PRESENT_EVENT_MASK_CONFIGURE_NOTIFY;
+
+	if (!drawable->use_idle_fence)
+		event_mask |= XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY;
+
+	pthread_mutex_unlock(&display->lock);
+
+	drawable->special_ev = x_init_special_event_queue(display->xcb_connection, drawable->xcb_window,
+							  event_mask, NULL);
+
+	if (env_uint("DRI3WS_WAIT_FENCE", 0)) {
+		uint32_t caps = x_get_present_capabilities(display->xcb_connection, drawable->xcb_window);
+
+		if (caps & XCB_PRESENT_CAPABILITY_FENCE)
+			drawable->use_wait_fence = true;
+		else
+			ERR("X server does not support present wait fences");
+	}
+
+	pthread_mutex_lock(&display->lock);
+
+	if (drawable->use_wait_fence)
+		StartCompletionService(&display->completions, display->pvr_data);
+
+	drawable->next = display->drawables;
+	display->drawables = drawable;
+	pthread_mutex_unlock(&display->lock);
+
+	DBG("drawable=%p created", drawable);
+
+	return WSEGL_SUCCESS;
+}
+
+static WSEGLError WSEGL_CreatePixmapDrawable(WSEGLDisplayHandle hDisplay,
+					     WSEGLConfig *psConfig,
+					     WSEGLDrawableHandle *phDrawable,
+					     NativePixmapType hNativePixmap,
+					     WSEGLRotationAngle *eRotationAngle)
+{
+	struct driws_display *display = (struct driws_display*)hDisplay;
+
+	DBG("display=%p, native=%lx", hDisplay, hNativePixmap);
+
+	if (!psConfig || !(psConfig->ui32DrawableType & WSEGL_DRAWABLE_PIXMAP))
+		return WSEGL_BAD_MATCH;
+
+	struct driws_import *import = acquire_import(display, hNativePixmap);
+	if (!import)
+		return WSEGL_BAD_NATIVE_PIXMAP;
+
+	uint32_t depth, bpp;
+
+	format2bytespp(psConfig->ePixelFormat, &depth, &bpp);
+
+	WSEGLError err = WSEGL_SUCCESS;
+	struct driws_drawable *drawable = NULL;
 
-			if (depth_iter.data->depth == 16 &&
-			    (visual_iter.data->red_mask == 0xF800) &&
-			    (visual_iter.data->green_mask == 0x07E0) &&
-			    (visual_iter.data->blue_mask == 0x001F)) {
+	if (import->bpp != bpp) {
+		ERR("pixmap 0x%lx has %u bpp, config needs %u", hNativePixmap, import->bpp, bpp);
+		err = WSEGL_BAD_MATCH;
+	} else if (!(drawable = calloc(1, sizeof(struct driws_drawable)))) {
+		err = WSEGL_OUT_OF_MEMORY;
+	}
 
-				display->wsegl_configs[num_cfgs].ui32DrawableType = WSEGL_DRAWABLE_WINDOW;
-				display->wsegl_configs[num_cfgs].ePixelFormat = WSEGL_PIXELFORMAT_RGB565;
-				display->wsegl_configs[num_cfgs].ulNativeVisualID = visual_iter.data->visual_id;
-				display->wsegl_configs[num_cfgs].ulNativeVisualType = visual_iter.data->_class;
-				display->wsegl_configs[num_cfgs].eTransparentType = WSEGL_OPAQUE;
+	if (err != WSEGL_SUCCESS) {
+		pthread_mutex_lock(&display->lock);
+		release_import(import);
+		pthread_mutex_unlock(&display->lock);
 
-				num_cfgs++;
+		return err;
+	}
 
-				break;
-			}
-		}
+	drawable->drawable_type = DRI3WS_DRAWABLE_PIXMAP;
+	drawable->display = display;
+	drawable->xcb_window = hNativePixmap;
+	drawable->wsegl_pixel_format = psConfig->ePixelFormat;
+	drawable->width = import->width;
+	drawable->height = import->height;
+	drawable->import = import;
+
+	*phDrawable = (WSEGLDrawableHandle)drawable;
+
+	*eRotationAngle = WSEGL_ROTATE_0;
+
+	DBG("drawable=%p created", drawable);
+
+	return WSEGL_SUCCESS;
+}
+
+static WSEGLError WSEGL_DeleteDrawable(WSEGLDrawableHandle hDrawable)
+{
+	struct driws_drawable *drawable = (struct driws_drawable*)hDrawable;
+	struct driws_display *display = drawable->display;
+
+	DBG("drawable=%p", drawable);
+
+	if (drawable->drawable_type == DRI3WS_DRAWABLE_PIXMAP) {
+		pthread_mutex_lock(&display->lock);
+		release_import(drawable->import);
+		pthread_mutex_unlock(&display->lock);
+
+		free(drawable);
+
+		return WSEGL_SUCCESS;
 	}
 
-	display->wsegl_configs[num_cfgs].ui32DrawableType = WSEGL_NO_DRAWABLE;
+	if (env_uint("DRI3WS_STATS", 0)) {
+		printf("DRI3WS drawable 0x%x: %llu frames, %llu round trips, "
+		       "%llu damaged frames saving %llu bytes\n", drawable->xcb_window,
+		       (unsigned long long)drawable->frames,
+		       (unsigned long long)drawable->round_trips,
+		       (unsigned long long)drawable->damaged_frames,
+		       (unsigned long long)drawable->damage_bytes_saved);
+		print_frame_stats(drawable);
+	}
 
-	if (!InitialiseServices(&display->pvr_data)) {
-		//error = WSEGL_CANNOT_INITIALISE;
-		FAIL("InitialiseServices failed");
+	pthread_mutex_lock(&display->lock);
+
+	for (struct driws_drawable **p = &display->drawables; *p; p = &(*p)->next) {
+		if (*p != drawable)
+			continue;
+
+		*p = drawable->next;
+		break;
 	}
 
-	// Keep a copy of the native display
-	display->xdisplay = dpy;
-	display->xcb_connection = c;
-	display->xcb_screen = screen;
+	discard_present_requests(drawable);
 
-	// Initialise the ref count
-	display->ref_count = 1;
+	x_uninit_special_event_queue(display->xcb_connection, drawable->special_ev);
 
-	// Save the DRM file descriptor.
-	display->drm_fd = drm_fd;
+	destroy_retired_buffers(display, drawable);
 
-#ifdef DRI3WS_USE_GBM
-	struct gbm_device* gbm = gbm_create_device(drm_fd);
-	FAIL_IF(!gbm, "no gbm");
+	if (drawable->damage_region)
+		xcb_xfixes_destroy_region(display->xcb_connection, drawable->damage_region);
 
-	display->gbm = gbm;
-#endif
-	if (!s_displays) {
-		s_displays = display;
-	} else {
-		struct driws_display *d = s_displays;
-		while (d->next)
-			d = d->next;
-		d->next = display;
+	for (unsigned i = 0; i < ARRAY_SIZE(drawable->buffers); ++i) {
+		if (!drawable->buffers[i])
+			continue;
+
+		release_buffer(drawable->buffers[i]);
+
+		drawable->buffers[i] = NULL;
 	}
 
-	// Return the address of the caps + configs structures
-	*psCapabilities = s_driws_caps;
-	*psConfigs = display->wsegl_configs;
-	*phDisplay = (WSEGLDisplayHandle)display;
+	pthread_mutex_unlock(&display->lock);
 
-	DBG("Done, phDisplay %p", phDisplay);
+	free(drawable);
 
 	return WSEGL_SUCCESS;
+}
 
-	// XXX cleanup
+/*
+ * Returns a region holding the damage set for this swap, or None for full
+ * damage. The damage is consumed.
+ */
+static xcb_xfixes_region_t get_damage_region(struct driws_drawable *drawable)
+{
+	struct driws_display *display = drawable->display;
+	uint32_t n = drawable->num_damage_rects;
+	uint64_t area = 0;
+
+	if (!n)
+		return None;
+
+	drawable->num_damage_rects = 0;
+
+	if (!drawable->damage_region) {
+		drawable->damage_region = xcb_generate_id(display->xcb_connection);
+		xcb_xfixes_create_region(display->xcb_connection, drawable->damage_region,
+					 n, drawable->damage_rects);
+	} else {
+		xcb_xfixes_set_region(display->xcb_connection, drawable->damage_region,
+				      n, drawable->damage_rects);
+	}
+
+	// Overlapping rectangles are counted twice, which only makes the
+	// estimate of the savings conservative
+	for (uint32_t i = 0; i < n; ++i)
+		area += (uint64_t)drawable->damage_rects[i].width * drawable->damage_rects[i].height;
+
+	uint64_t window_area = (uint64_t)drawable->width * drawable->height;
+	uint32_t depth, bpp;
+
+	format2bytespp(drawable->wsegl_pixel_format, &depth, &bpp);
+
+	drawable->damaged_frames++;
+	if (area < window_area)
+		drawable->damage_bytes_saved += (window_area - area) * (bpp / 8);
+
+	return drawable->damage_region;
 }
 
-static WSEGLError WSEGL_CloseDisplay(WSEGLDisplayHandle hDisplay)
+/*
+ * Query the map state after a skip, and periodically otherwise. Called
+ * without the display lock, as this is a round trip. Returns false if the
+ * window is gone.
+ */
+static bool check_mapped(struct driws_drawable *drawable)
 {
-	struct driws_display *display = (struct driws_display*)hDisplay;
+	uint64_t now = get_time_us();
 
-	DBG("display=%p", display);
+	// Set by the event handler under the display lock
+	if (!__atomic_exchange_n(&drawable->check_mapped, false, __ATOMIC_ACQ_REL) &&
+	    now - drawable->map_check_us < DRI3WS_HIDDEN_POLL_MS * 1000)
+		return true;
 
-	// Only close displays with a ref count of 0
-	display->ref_count--;
-	if (display->ref_count)
+	enum x_window_state state = x_get_window_state(drawable->display->xcb_connection,
+						       drawable->xcb_window);
+	if (state == X_WINDOW_ERROR)
+		return false;
+
+	drawable->unmapped = state == X_WINDOW_UNMAPPED;
+	drawable->map_check_us = now;
+
+	return true;
+}
+
+/*
+ * Called with the display lock held, which is dropped while sleeping.
+ * Without a rate, an unmapped window blocks until it is mapped again, and
+ * a mapped but skipped one, e.g. fully covered, is throttled to
+ * DRI3WS_DEFAULT_HIDDEN_FPS. Returns false if the window is gone.
+ */
+static bool throttle_hidden(struct driws_drawable *drawable)
+{
+	struct driws_display *display = drawable->display;
+	bool block = drawable->unmapped && drawable->hidden_fps == 0;
+	enum x_window_state state = X_WINDOW_VIEWABLE;
+
+	drawable->hidden_frames++;
+
+	pthread_mutex_unlock(&display->lock);
+
+	if (block) {
+		while ((state = x_get_window_state(display->xcb_connection, drawable->xcb_window)) ==
+		       X_WINDOW_UNMAPPED)
+			usleep(DRI3WS_HIDDEN_POLL_MS * 1000);
+	} else {
+		uint32_t fps = drawable->hidden_fps ? drawable->hidden_fps : DRI3WS_DEFAULT_HIDDEN_FPS;
+		uint64_t next = drawable->hidden_swap_us + 1000000 / fps;
+		uint64_t now = get_time_us();
+
+		if (now < next)
+			usleep(next - now);
+	}
+
+	pthread_mutex_lock(&display->lock);
+
+	if (state == X_WINDOW_ERROR)
+		return false;
+
+	drawable->hidden_swap_us = get_time_us();
+
+	// Mapped again. If it is still skipped, it is detected as hidden
+	// again after a few frames.
+	if (block) {
+		drawable->unmapped = false;
+		drawable->hidden = false;
+		drawable->skip_frames = 0;
+		drawable->map_check_us = drawable->hidden_swap_us;
+	}
+
+	return true;
+}
+
+static WSEGLError WSEGL_SwapDrawable(WSEGLDrawableHandle hDrawable, unsigned long ui32Data)
+{
+	struct driws_drawable *drawable = (struct driws_drawable*)hDrawable;
+	struct driws_buffer *buffer = drawable->buffers[drawable->current_back_idx];
+	struct driws_display *display = drawable->display;
+	struct xcb_connection_t *c = display->xcb_connection;
+
+	DBG("drawable=%p, current-back=%u", drawable, drawable->current_back_idx);
+
+	// Pixmaps are rendered in place, so there is nothing to present. X
+	// requests on the pixmap can't wait for a fence, so the rendering must
+	// be finished when the swap returns.
+	if (drawable->drawable_type == DRI3WS_DRAWABLE_PIXMAP) {
+		WaitForOpsComplete(display->pvr_data, drawable->import->pvr_meminfo->psClientSyncInfo);
 		return WSEGL_SUCCESS;
+	}
 
-#ifdef DRI3WS_USE_GBM
-	gbm_device_destroy(display->gbm);
-#endif
-	close(display->drm_fd);
+	if (drawable->hidden_throttle && !check_mapped(drawable))
+		return WSEGL_BAD_NATIVE_WINDOW;
 
-	DeInitialiseServices(&display->pvr_data);
+	xcb_sync_fence_t wait_fence = None;
 
-	for (struct driws_display *d = s_displays, *prev = NULL; d; prev = d, d = d->next)
-	{
-		if (d != display)
-			continue;
+	if (drawable->use_wait_fence) {
+		if (!buffer->wait_shm)
+			buffer->wait_fence = x_create_shm_fence(c, display->xcb_screen->root, &buffer->wait_shm);
 
-		if (prev)
-			prev->next = display->next;
-		else
-			s_displays = display->next;
+		// The server holds the present until rendering has finished
+		queue_fence_trigger(buffer);
+		wait_fence = buffer->wait_fence;
+	} else {
+		// Wait for backbuffer render to finish. Without a wait fence the
+		// server reads the buffer as soon as the present arrives.
+		struct pvr_sync_point point;
+		struct pvr_wait_stats ws;
 
-		break;
+		GetSyncPoint(buffer->pvr_meminfo->psClientSyncInfo, &point);
+
+		bool done = WaitForSyncPointTimeout(display->pvr_data, &point,
+						    display->gpu_wait_timeout_us, display->gpu_spin_us, &ws);
+
+		drawable->gpu_wait_loops += ws.loops;
+		drawable->gpu_wait_spurious += ws.spurious;
+		drawable->gpu_wait_us += ws.waited_us;
+
+		if (!done) {
+			drawable->gpu_wait_timeouts++;
+			return WSEGL_RETRY;
+		}
 	}
 
-	free(display);
+	pthread_mutex_lock(&display->lock);
+
+	// With a wait fence this misses the GPU time still to come
+	update_render_time(drawable, get_time_us());
+
+	xcb_sync_fence_t idle_fence = None;
+
+	if (drawable->use_idle_fence) {
+		if (!buffer->idle_shm)
+			buffer->idle_fence = x_create_shm_fence(c, display->xcb_screen->root, &buffer->idle_shm);
+
+		xshmfence_reset(buffer->idle_shm);
+		idle_fence = buffer->idle_fence;
+
+		sweep_retired_buffers(display);
+	}
+
+	// XXX not needed, I think
+	if (!display->event_thread.running)
+		poll_special_events(drawable);
+
+	// Errors from earlier frames are reported here, as the present
+	// requests are not waited for
+	if (!check_present_requests(drawable, drawable->pending_count == DRI3WS_MAX_PENDING_PRESENTS)) {
+		pthread_mutex_unlock(&display->lock);
+		return WSEGL_BAD_NATIVE_WINDOW;
+	}
+
+	buffer->busy = true;
+
+	uint32_t options = XCB_PRESENT_OPTION_NONE;
+	//if (force_copy)
+	//options |= XCB_PRESENT_OPTION_COPY;
+
+	drawable->send_sbc++;
+
+	uint32_t serial = (uint32_t)drawable->send_sbc;
+	uint64_t target_msc = 0;
+	uint64_t divisor = 0;
+	uint64_t remainder = 0;
+
+	if (drawable->swap_interval == 0) {
+		// Present immediately, tearing allowed
+		options |= XCB_PRESENT_OPTION_ASYNC;
+	} else if (drawable->present_mode == DRI3WS_PRESENT_MODE_MAILBOX) {
+		// Target the same vblank as a present still in the queue, so
+		// that the server replaces it and releases its buffer
+		target_msc = drawable->msc + drawable->swap_interval;
+
+		if (drawable->send_sbc - 1 > drawable->recv_sbc) {
+			uint64_t prev = drawable->presents[(drawable->send_sbc - 1) % DRI3WS_PRESENT_HISTORY].target_msc;
+			target_msc = MAX(target_msc, prev);
+		}
+	} else {
+		// Each queued frame is shown for swap_interval vblanks
+		target_msc = drawable->msc +
+			drawable->swap_interval * (drawable->send_sbc - drawable->recv_sbc);
+	}
+
+	xcb_xfixes_region_t update = None;
+
+	// The X server only replaces a queued present whose update region is
+	// None, so damage would defeat mailbox mode. It is dropped instead.
+	if (drawable->present_mode == DRI3WS_PRESENT_MODE_MAILBOX && drawable->swap_interval)
+		drawable->num_damage_rects = 0;
+	else
+		update = get_damage_region(drawable);
+
+	buffer->last_sbc = drawable->send_sbc;
+
+	struct driws_present_info *info = &drawable->presents[drawable->send_sbc % DRI3WS_PRESENT_HISTORY];
+	info->swap_ust = get_time_us();
+	info->target_msc = target_msc;
+
+	xcb_void_cookie_t cookie = xcb_present_pixmap_checked(c,
+							      drawable->xcb_window,
+							      buffer->x_pixmap,
+							      serial,
+							      0, update, 0, 0, // valid, update, x_off, y_off
+							      None, /* target_crtc */
+							      wait_fence, /* wait fence */
+							      idle_fence, /* idle fence */
+							      options,
+							      target_msc,
+							      divisor, /* divisor */
+							      remainder, /* remainder */
+							      0, /* notifiers len */
+							      NULL); /* notifiers */
+
+	uint32_t idx = (drawable->pending_head + drawable->pending_count) % DRI3WS_MAX_PENDING_PRESENTS;
+	drawable->pending_presents[idx].sequence = cookie.sequence;
+	drawable->pending_presents[idx].pixmap = buffer->x_pixmap;
+	drawable->pending_presents[idx].sbc = drawable->send_sbc;
+	drawable->pending_count++;
+
+	xcb_flush(c);
+
+	drawable->frames++;
+
+	uint32_t depth = drawable->send_sbc - drawable->recv_sbc;
+	drawable->max_queue_depth = MAX(drawable->max_queue_depth, depth);
+
+	WSEGLError ret = WSEGL_SUCCESS;
+
+	// Bound how far rendering gets ahead of the display, counting frames
+	// until completion rather than until their buffers are released
+	if (drawable->max_frames_in_flight && depth >= drawable->max_frames_in_flight) {
+		drawable->throttled_frames++;
+
+		while (drawable->send_sbc - drawable->recv_sbc >= drawable->max_frames_in_flight) {
+			// A failed present never completes, so collect errors first.
+			// Replies that already arrived are enough, unless the ring is
+			// full or the frame waited for still has none: only then is
+			// a round trip needed before its CompleteNotify can be relied on.
+			if (!check_present_requests(drawable, drawable->pending_count == DRI3WS_MAX_PENDING_PRESENTS))
+				ret = WSEGL_BAD_NATIVE_WINDOW;
+
+			if (drawable->pending_count &&
+			    drawable->pending_presents[drawable->pending_head].sbc <= drawable->recv_sbc + 1) {
+				if (!check_present_requests(drawable, true))
+					ret = WSEGL_BAD_NATIVE_WINDOW;
+				continue;
+			}
+
+			if (drawable->send_sbc - drawable->recv_sbc < drawable->max_frames_in_flight)
+				break;
+
+			DBG("%u frames in flight, waiting", (uint32_t)(drawable->send_sbc - drawable->recv_sbc));
+			wait_for_events(drawable);
+		}
+	}
+
+	drawable->current_back_idx = (drawable->current_back_idx + 1) % drawable->num_buffers;
+
+	if (drawable->present_mode == DRI3WS_PRESENT_MODE_MAILBOX)
+		select_idle_back_buffer(drawable);
+
+	// Keep the application from rendering frames nobody sees
+	if ((drawable->hidden || drawable->unmapped) && !throttle_hidden(drawable))
+		ret = WSEGL_BAD_NATIVE_WINDOW;
+
+	if (drawable->adaptive)
+		adapt_swapchain(drawable);
+
+	pthread_mutex_unlock(&display->lock);
+
+	return ret;
+}
+
+static WSEGLError WSEGL_SwapControlInterval(WSEGLDrawableHandle hDrawable, unsigned long ui32Interval)
+{
+	struct driws_drawable *drawable = (struct driws_drawable*)hDrawable;
+
+	DBG("drawable=%p, interval=%lu", drawable, ui32Interval);
+
+	pthread_mutex_lock(&drawable->display->lock);
+
+	drawable->swap_interval = MIN(ui32Interval, DRI3WS_MAX_SWAP_INTERVAL);
+
+	ensure_min_swapchain_depth(drawable);
+
+	pthread_mutex_unlock(&drawable->display->lock);
 
 	return WSEGL_SUCCESS;
 }
 
-static WSEGLError WSEGL_CreateWindowDrawable(WSEGLDisplayHandle hDisplay,
-					     WSEGLConfig *psConfig,
-					     WSEGLDrawableHandle *phDrawable,
-					     NativeWindowType hNativeWindow,
-					     WSEGLRotationAngle *eRotationAngle)
+static WSEGLError WSEGL_WaitNative(WSEGLDrawableHandle hDrawable, unsigned long ui32Engine)
 {
-	struct driws_display *display = (struct driws_display*)hDisplay;
+	FAIL("unimplemented");
+}
+
+/*
+ * Copy the drawable's render buffer, which holds what eglCopyBuffers should
+ * copy, to a pixmap. The X server copies between pixmaps of the same depth.
+ * Otherwise, or with DRI3WS_COPY_CPU, the pixmap's storage is imported and
+ * the pixels are converted to the pixmap's format through its mapping.
+ */
+static WSEGLError WSEGL_CopyFromDrawable(WSEGLDrawableHandle hDrawable, NativePixmapType hNativePixmap)
+{
+	struct driws_drawable *drawable = (struct driws_drawable*)hDrawable;
+	struct driws_display *display = drawable->display;
+	xcb_connection_t *c = display->xcb_connection;
+
+	DBG("drawable=%p, pixmap=%lx", drawable, hNativePixmap);
+
+	xcb_pixmap_t src_pixmap;
+	uint32_t src_depth, bpp, src_stride;
+	uint8_t *src_map;
+	PVRSRV_CLIENT_MEM_INFO *src_meminfo;
+
+	format2bytespp(drawable->wsegl_pixel_format, &src_depth, &bpp);
+
+	if (drawable->drawable_type == DRI3WS_DRAWABLE_PIXMAP) {
+		struct driws_import *import = drawable->import;
+
+		src_pixmap = import->pixmap;
+		src_depth = import->depth;
+		src_stride = import->stride_bytes;
+		src_map = import->mmap;
+		src_meminfo = import->pvr_meminfo;
+	} else {
+		struct driws_buffer *buffer = drawable->buffers[drawable->current_back_idx];
+
+		if (!buffer)
+			return WSEGL_BAD_DRAWABLE;
+
+		src_pixmap = buffer->x_pixmap;
+		src_stride = buffer->stride_bytes;
+		src_map = buffer->mmap;
+		src_meminfo = buffer->pvr_meminfo;
+	}
+
+	uint32_t width, height, depth;
+
+	if (!x_get_pixmap_geometry(c, hNativePixmap, &width, &height, &depth))
+		return WSEGL_BAD_NATIVE_PIXMAP;
+
+	width = MIN(width, drawable->width);
+	height = MIN(height, drawable->height);
 
-	DBG("display=%p, native=%lx, format %s", hDisplay, hNativeWindow, format2str(psConfig->ePixelFormat));
+	struct driws_import *target = NULL;
+	enum pixconv_format dst_format;
 
-	if (!psConfig || !(psConfig->ui32DrawableType & WSEGL_DRAWABLE_WINDOW))
-		return WSEGL_BAD_MATCH;
+	if (display->copy_cpu || depth != src_depth) {
+		if (!depth2pixconv(depth, &dst_format)) {
+			ERR("pixmap 0x%lx has unsupported depth %u", hNativePixmap, depth);
+			return WSEGL_BAD_MATCH;
+		}
 
-	struct driws_drawable *drawable = calloc(1, sizeof(struct driws_drawable));
-	if (!drawable)
-		return WSEGL_OUT_OF_MEMORY;
+		target = acquire_import(display, hNativePixmap);
+		if (!target)
+			return WSEGL_BAD_NATIVE_PIXMAP;
 
-	DBG("  allocated drawable=%p", drawable);
+		if (target->bpp != pixconv_bytespp(dst_format) * 8) {
+			ERR("pixmap 0x%lx has %u bpp at depth %u", hNativePixmap, target->bpp, depth);
 
-	drawable->drawable_type = DRI3WS_DRAWABLE_WINDOW;
-	drawable->display = display;
-	drawable->xcb_window = hNativeWindow;
-	drawable->wsegl_pixel_format = psConfig->ePixelFormat;
+			pthread_mutex_lock(&display->lock);
+			release_import(target);
+			pthread_mutex_unlock(&display->lock);
 
-	*phDrawable = (WSEGLDrawableHandle)drawable;
+			return WSEGL_BAD_MATCH;
+		}
+	}
 
-	*eRotationAngle = WSEGL_ROTATE_0;
+	// CopyArea can't wait for a fence, and the pixmap must hold the copy
+	// when eglCopyBuffers returns, so this wait stays synchronous
+	WaitForOpsComplete(display->pvr_data, src_meminfo->psClientSyncInfo);
 
-	drawable->special_ev = x_init_special_event_queue(display->xcb_connection, drawable->xcb_window, NULL);
+	if (!target) {
+		xcb_gcontext_t gc = xcb_generate_id(c);
+		uint32_t no_exposures = 0;
 
-	DBG("drawable=%p created", drawable);
+		// Keep NoExpose events out of the application's event queue
+		xcb_create_gc(c, gc, hNativePixmap, XCB_GC_GRAPHICS_EXPOSURES, &no_exposures);
+		xcb_copy_area(c, src_pixmap, hNativePixmap, gc, 0, 0, 0, 0, width, height);
+		xcb_free_gc(c, gc);
+		xcb_flush(c);
+
+		return WSEGL_SUCCESS;
+	}
+
+	// An XRGB8888 buffer's undefined alpha becomes 0xff in a depth 32
+	// pixmap, and 565 is expanded or packed as needed
+	pixconv_convert(target->mmap, target->stride_bytes, dst_format,
+			src_map, src_stride, format2pixconv(drawable->wsegl_pixel_format),
+			width, height);
+
+	pthread_mutex_lock(&display->lock);
+	release_import(target);
+	pthread_mutex_unlock(&display->lock);
 
 	return WSEGL_SUCCESS;
 }
 
-static WSEGLError WSEGL_CreatePixmapDrawable(WSEGLDisplayHandle hDisplay,
-					     WSEGLConfig *psConfig,
-					     WSEGLDrawableHandle *phDrawable,
-					     NativePixmapType hNativePixmap,
-					     WSEGLRotationAngle *eRotationAngle)
+/*
+ * Upload converted rows with PutImage, in as few requests as the server's
+ * request size allows.
+ */
+static void put_converted_image(struct driws_display *display, xcb_pixmap_t pixmap, uint32_t depth,
+				enum pixconv_format dst_format, const void *src, uint32_t src_stride,
+				enum pixconv_format src_format, uint32_t width, uint32_t height)
 {
-	FAIL("Not implemented");
-}
+	xcb_connection_t *c = display->xcb_connection;
 
-static WSEGLError WSEGL_DeleteDrawable(WSEGLDrawableHandle hDrawable)
-{
-	struct driws_drawable *drawable = (struct driws_drawable*)hDrawable;
-	struct driws_display *display = drawable->display;
+	// Scanlines are padded to 32 bits
+	uint32_t dst_stride = round_up_to(width * pixconv_bytespp(dst_format), 4);
+	uint32_t max_bytes = xcb_get_maximum_request_length(c) * 4 - sizeof(xcb_put_image_request_t);
+	uint32_t chunk_rows = CLAMP(max_bytes / dst_stride, 1, height);
 
-	DBG("drawable=%p", drawable);
+	uint8_t *chunk = malloc(chunk_rows * dst_stride);
+	FAIL_IF(!chunk, "out of memory");
 
-	x_uninit_special_event_queue(display->xcb_connection, drawable->special_ev);
+	xcb_gcontext_t gc = xcb_generate_id(c);
+	uint32_t no_exposures = 0;
+	xcb_create_gc(c, gc, pixmap, XCB_GC_GRAPHICS_EXPOSURES, &no_exposures);
 
-	for (unsigned i = 0; i < ARRAY_SIZE(drawable->buffers); ++i) {
-		if (!drawable->buffers[i])
-			continue;
+	for (uint32_t y = 0; y < height; y += chunk_rows) {
+		uint32_t rows = MIN(chunk_rows, height - y);
 
-		destroy_buffer(drawable->buffers[i]);
+		pixconv_convert(chunk, dst_stride, dst_format,
+				(const uint8_t *)src + y * src_stride, src_stride, src_format,
+				width, rows);
 
-		drawable->buffers[i] = NULL;
+		xcb_put_image(c, XCB_IMAGE_FORMAT_Z_PIXMAP, pixmap, gc, width, rows, 0, y, 0, depth,
+			      rows * dst_stride, chunk);
 	}
 
-	free(drawable);
+	xcb_free_gc(c, gc);
+	xcb_flush(c);
 
-	return WSEGL_SUCCESS;
+	free(chunk);
 }
 
-static WSEGLError WSEGL_SwapDrawable(WSEGLDrawableHandle hDrawable, unsigned long ui32Data)
+/*
+ * Copy a pbuffer to a pixmap, converting to the pixmap's format. The
+ * stride is in pixels, as in WSEGLDrawableParams. The pixels are sent
+ * with PutImage, or with DRI3WS_COPY_CPU written straight to the pixmap's
+ * imported storage.
+ */
+static WSEGLError copy_pbuffer_to_pixmap(struct driws_display *display, void *pvAddress,
+					 unsigned long ui32Width, unsigned long ui32Height,
+					 unsigned long ui32Stride, WSEGLPixelFormat ePixelFormat,
+					 NativePixmapType hNativePixmap)
 {
-	struct driws_drawable *drawable = (struct driws_drawable*)hDrawable;
-	struct driws_buffer *buffer = drawable->buffers[drawable->current_back_idx];
-	struct driws_display *display = drawable->display;
-	struct xcb_connection_t *c = display->xcb_connection;
+	uint32_t width, height, depth;
 
-	DBG("drawable=%p, current-back=%u", drawable, drawable->current_back_idx);
+	if (!x_get_pixmap_geometry(display->xcb_connection, hNativePixmap, &width, &height, &depth))
+		return WSEGL_BAD_NATIVE_PIXMAP;
 
-	// Wait for backbuffer render to finish
-	WaitForOpsComplete(&display->pvr_data, buffer->pvr_meminfo->psClientSyncInfo);
+	enum pixconv_format dst_format;
 
-	// XXX not needed, I think
-	poll_special_events(drawable);
+	if (!depth2pixconv(depth, &dst_format)) {
+		ERR("pixmap 0x%lx has unsupported depth %u", hNativePixmap, depth);
+		return WSEGL_BAD_MATCH;
+	}
 
-	buffer->busy = true;
+	enum pixconv_format src_format = format2pixconv(ePixelFormat);
+	uint32_t src_stride = ui32Stride * pixconv_bytespp(src_format);
 
-	uint32_t options = XCB_PRESENT_OPTION_NONE;
-	//if (swap_interval == 0)
-	//options |= XCB_PRESENT_OPTION_ASYNC;
-	//if (force_copy)
-	//options |= XCB_PRESENT_OPTION_COPY;
+	width = MIN(width, ui32Width);
+	height = MIN(height, ui32Height);
 
-	uint32_t serial = drawable->current_back_idx; /* scb */
-	uint32_t target_msc = 0;
-	uint32_t divisor = 3;
-	uint32_t remainder = drawable->current_back_idx;
+	if (!display->copy_cpu) {
+		put_converted_image(display, hNativePixmap, depth, dst_format,
+				    pvAddress, src_stride, src_format, width, height);
+		return WSEGL_SUCCESS;
+	}
 
-	xcb_void_cookie_t cookie = xcb_present_pixmap_checked(c,
-							      drawable->xcb_window,
-							      buffer->x_pixmap,
-							      serial,
-							      0, 0, 0, 0, // valid, update, x_off, y_off
-							      None, /* target_crtc */
-							      None, /* wait fence */
-							      None, /* idle fence */
-							      options,
-							      target_msc,
-							      divisor, /* divisor */
-							      remainder, /* remainder */
-							      0, /* notifiers len */
-							      NULL); /* notifiers */
+	struct driws_import *target = acquire_import(display, hNativePixmap);
+	if (!target)
+		return WSEGL_BAD_NATIVE_PIXMAP;
 
-	xcb_generic_error_t *error;
-	if ((error = xcb_request_check(c, cookie)))
-		FAIL("present pixmap failed");
+	if (target->bpp != pixconv_bytespp(dst_format) * 8) {
+		ERR("pixmap 0x%lx has %u bpp at depth %u", hNativePixmap, target->bpp, depth);
 
-	xcb_flush(c);
+		pthread_mutex_lock(&display->lock);
+		release_import(target);
+		pthread_mutex_unlock(&display->lock);
 
-	drawable->current_back_idx = (drawable->current_back_idx + 1) % ARRAY_SIZE(drawable->buffers);
+		return WSEGL_BAD_MATCH;
+	}
 
-	return WSEGL_SUCCESS;
-}
+	pixconv_convert(target->mmap, target->stride_bytes, dst_format,
+			pvAddress, src_stride, src_format, width, height);
 
-static WSEGLError WSEGL_SwapControlInterval(WSEGLDrawableHandle hDrawable, unsigned long ui32Interval)
-{
-	DBG();
+	pthread_mutex_lock(&display->lock);
+	release_import(target);
+	pthread_mutex_unlock(&display->lock);
 
 	return WSEGL_SUCCESS;
 }
 
-static WSEGLError WSEGL_WaitNative(WSEGLDrawableHandle hDrawable, unsigned long ui32Engine)
-{
-	FAIL("unimplemented");
-}
-
-static WSEGLError WSEGL_CopyFromDrawable(WSEGLDrawableHandle hDrawable, NativePixmapType hNativePixmap)
-{
-	FAIL("unimplemented");
-}
-
 static WSEGLError WSEGL_CopyFromPBuffer(void *pvAddress,
 					unsigned long ui32Width,
 					unsigned long ui32Height,
@@ -809,7 +2784,28 @@ static WSEGLError WSEGL_CopyFromPBuffer(void *pvAddress,
 					WSEGLPixelFormat ePixelFormat,
 					NativePixmapType hNativePixmap)
 {
-	FAIL("unimplemented");
+	DBG("address=%p, %lux%lu, stride %lu, format %s, pixmap=%lx", pvAddress, ui32Width, ui32Height,
+	    ui32Stride, format2str(ePixelFormat), hNativePixmap);
+
+	// Only the pixmap's XID is passed in, not its display, so the copy goes
+	// through the first display initialised and pixmaps of other X
+	// connections can't be copied to. A reference keeps the display from
+	// being closed meanwhile.
+	pthread_mutex_lock(&s_displays_lock);
+	struct driws_display *display = s_displays;
+	if (display)
+		display->ref_count++;
+	pthread_mutex_unlock(&s_displays_lock);
+
+	if (!display)
+		return WSEGL_BAD_NATIVE_DISPLAY;
+
+	WSEGLError ret = copy_pbuffer_to_pixmap(display, pvAddress, ui32Width, ui32Height,
+						ui32Stride, ePixelFormat, hNativePixmap);
+
+	WSEGL_CloseDisplay((WSEGLDisplayHandle)display);
+
+	return ret;
 }
 
 static WSEGLError WSEGL_GetDrawableParameters(WSEGLDrawableHandle hDrawable,
@@ -818,16 +2814,41 @@ static WSEGLError WSEGL_GetDrawableParameters(WSEGLDrawableHandle hDrawable,
 					      unsigned long ulPlaneOffset)
 {
 	struct driws_drawable *drawable = (struct driws_drawable*)hDrawable;
+	struct driws_display *display = drawable->display;
 
 	DBG("drawable=%p, current-back=%u", drawable, drawable->current_back_idx);
 
+	if (drawable->drawable_type == DRI3WS_DRAWABLE_PIXMAP) {
+		struct driws_import *import = drawable->import;
+
+		memset(psRenderParams, 0, sizeof(*psRenderParams));
+
+		psRenderParams->ui32Width       = import->width;
+		psRenderParams->ui32Height      = import->height;
+		psRenderParams->ePixelFormat    = drawable->wsegl_pixel_format;
+		psRenderParams->ui32Stride      = import->stride_bytes / (import->bpp / 8);
+		psRenderParams->pvLinearAddress = import->mmap;
+		psRenderParams->ui32HWAddress   = import->pvr_meminfo->sDevVAddr.uiAddr;
+		psRenderParams->hMemInfo        = (IMG_HANDLE)import->pvr_meminfo;
+
+		*psSourceParams                 = *psRenderParams;
+
+		return WSEGL_SUCCESS;
+	}
+
+	pthread_mutex_lock(&display->lock);
+
 	struct driws_buffer *buffer = drawable->buffers[drawable->current_back_idx];
 
-	if (buffer && drawable->size_changed)
+	if (buffer && drawable->size_changed) {
+		pthread_mutex_unlock(&display->lock);
 		return WSEGL_BAD_DRAWABLE;
+	}
 
-	if (!buffer) {
+	if (!buffer || drawable->scanout_pending) {
 		if (!create_buffers(drawable)) {
+			pthread_mutex_unlock(&display->lock);
+
 			if (drawable->drawable_type == DRI3WS_DRAWABLE_WINDOW )
 				return WSEGL_BAD_NATIVE_WINDOW;
 			else
@@ -836,11 +2857,47 @@ static WSEGLError WSEGL_GetDrawableParameters(WSEGLDrawableHandle hDrawable,
 		buffer = drawable->buffers[drawable->current_back_idx];
 	}
 
-	while (buffer->busy) {
-		DBG("Buffer busy, waiting");
-		wait_special_event(drawable);
+	// A replaced present may have released another buffer already
+	if (drawable->present_mode == DRI3WS_PRESENT_MODE_MAILBOX &&
+	    buffer_is_busy(buffer) && select_idle_back_buffer(drawable))
+		buffer = drawable->buffers[drawable->current_back_idx];
+
+	if (buffer_is_busy(buffer)) {
+		drawable->adapt_blocked++;
+
+		if (!check_pixmap_presents(drawable, buffer->x_pixmap)) {
+			pthread_mutex_unlock(&display->lock);
+			return WSEGL_BAD_NATIVE_WINDOW;
+		}
+
+		if (buffer->idle_shm && buffer->busy) {
+			DBG("Buffer busy, waiting for idle fence");
+
+			pthread_mutex_unlock(&display->lock);
+			xshmfence_await(buffer->idle_shm);
+			pthread_mutex_lock(&display->lock);
+
+			idle_buffer(buffer);
+		}
+
+		while (buffer->busy) {
+			DBG("Buffer busy, waiting");
+			wait_for_events(drawable);
+		}
+	}
+
+	if (drawable->adaptive) {
+		uint32_t spare = 0;
+
+		for (unsigned i = 0; i < drawable->num_buffers; ++i)
+			if (drawable->buffers[i] != buffer && !buffer_is_busy(drawable->buffers[i]))
+				spare++;
+
+		drawable->adapt_min_spare = MIN(drawable->adapt_min_spare, spare);
 	}
 
+	pthread_mutex_unlock(&display->lock);
+
 	if (drawable->drawable_type == DRI3WS_DRAWABLE_UNKNOWN)
 		FAIL("bad drawable type");
 
@@ -871,9 +2928,306 @@ static WSEGLError WSEGL_DisconnectDrawable(WSEGLDrawableHandle hDrawable)
 
 static WSEGLError WSEGL_FlagStartFrame(WSEGLDrawableHandle hDrawable)
 {
+	struct driws_drawable *drawable = (struct driws_drawable*)hDrawable;
+
+	if (drawable)
+		drawable->frame_start_us = get_time_us();
+
 	return WSEGL_SUCCESS;
 }
 
+/*
+ * Find the display of dpy and return it locked. The display is locked
+ * before the list lock is dropped, and CloseDisplay takes the display lock
+ * after unlinking it, so the display can't be freed meanwhile.
+ */
+static struct driws_display *lock_display(Display *dpy)
+{
+	struct driws_display *display = NULL;
+
+	pthread_mutex_lock(&s_displays_lock);
+
+	for (struct driws_display *d = s_displays; d; d = d->next) {
+		if (d->xdisplay == dpy) {
+			display = d;
+			pthread_mutex_lock(&display->lock);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&s_displays_lock);
+
+	return display;
+}
+
+DRI3WS_EXPORT bool dri3ws_get_pool_stats(Display *dpy, struct dri3ws_pool_stats *stats)
+{
+	struct driws_display *display = lock_display(dpy);
+
+	if (!display)
+		return false;
+
+	stats->buffers = display->pool.count;
+	stats->max_buffers = display->pool.max_count;
+	stats->hits = display->pool.hits;
+	stats->misses = display->pool.misses;
+	stats->evictions = display->pool.evictions;
+
+	pthread_mutex_unlock(&display->lock);
+
+	return true;
+}
+
+/*
+ * Find the window drawable of window and return it with its display
+ * locked, so that it can't be deleted while it is used. Release it with
+ * unlock_drawable().
+ */
+static struct driws_drawable *lock_drawable(Display *dpy, Window window)
+{
+	struct driws_display *display = lock_display(dpy);
+	struct driws_drawable *drawable;
+
+	if (!display)
+		return NULL;
+
+	drawable = find_drawable(display, window);
+
+	if (!drawable || drawable->drawable_type != DRI3WS_DRAWABLE_WINDOW) {
+		pthread_mutex_unlock(&display->lock);
+		return NULL;
+	}
+
+	return drawable;
+}
+
+static void unlock_drawable(struct driws_drawable *drawable)
+{
+	pthread_mutex_unlock(&drawable->display->lock);
+}
+
+DRI3WS_EXPORT bool dri3ws_get_swap_stats(Display *dpy, Window window, struct dri3ws_swap_stats *stats)
+{
+	struct driws_drawable *drawable = lock_drawable(dpy, window);
+
+	if (!drawable)
+		return false;
+
+	stats->frames = drawable->frames;
+	stats->round_trips = drawable->round_trips;
+	stats->damaged_frames = drawable->damaged_frames;
+	stats->damage_bytes_saved = drawable->damage_bytes_saved;
+	stats->throttled_frames = drawable->throttled_frames;
+	stats->hidden_frames = drawable->hidden_frames;
+	stats->gpu_wait_loops = drawable->gpu_wait_loops;
+	stats->gpu_wait_spurious = drawable->gpu_wait_spurious;
+	stats->gpu_wait_us = drawable->gpu_wait_us;
+	stats->gpu_wait_timeouts = drawable->gpu_wait_timeouts;
+	stats->queue_depth = drawable->send_sbc - drawable->recv_sbc;
+	stats->max_queue_depth = drawable->max_queue_depth;
+
+	unlock_drawable(drawable);
+
+	return true;
+}
+
+DRI3WS_EXPORT unsigned dri3ws_get_frame_records(Display *dpy, Window window,
+						struct dri3ws_frame_record *records, unsigned max)
+{
+	struct driws_drawable *drawable = lock_drawable(dpy, window);
+
+	if (!drawable)
+		return 0;
+
+	unsigned count = read_frame_ring(&drawable->frame_ring, records, max);
+
+	unlock_drawable(drawable);
+
+	return count;
+}
+
+DRI3WS_EXPORT bool dri3ws_get_frame_stats(Display *dpy, Window window, struct dri3ws_frame_stats *stats)
+{
+	struct dri3ws_frame_record *records = malloc(DRI3WS_FRAME_RING_SIZE * sizeof(*records));
+
+	if (!records)
+		return false;
+
+	struct driws_drawable *drawable = lock_drawable(dpy, window);
+
+	if (!drawable) {
+		free(records);
+		return false;
+	}
+
+	unsigned count = read_frame_ring(&drawable->frame_ring, records, DRI3WS_FRAME_RING_SIZE);
+
+	unlock_drawable(drawable);
+
+	compute_frame_stats(records, count, stats);
+
+	free(records);
+
+	return true;
+}
+
+DRI3WS_EXPORT bool dri3ws_set_present_mode(Display *dpy, Window window, enum dri3ws_present_mode mode)
+{
+	struct driws_drawable *drawable = lock_drawable(dpy, window);
+
+	if (!drawable)
+		return false;
+
+	drawable->present_mode = mode;
+
+	ensure_min_swapchain_depth(drawable);
+
+	unlock_drawable(drawable);
+
+	return true;
+}
+
+DRI3WS_EXPORT bool dri3ws_predict_vblank(Display *dpy, Window window,
+					 uint64_t *next_vblank_ust, uint64_t *render_start_ust)
+{
+	struct driws_drawable *drawable = lock_drawable(dpy, window);
+
+	if (!drawable)
+		return false;
+
+	const struct driws_vblank_model *m = &drawable->vblank;
+
+	if (!m->valid) {
+		unlock_drawable(drawable);
+		return false;
+	}
+
+	uint64_t render_us = drawable->render_avg_us + 2 * drawable->render_dev_us +
+		drawable->display->vblank_margin_us;
+	uint64_t now = get_time_us();
+	uint64_t earliest = now + render_us;
+
+	// First vblank after a frame started now can be ready
+	uint64_t vblanks = 0;
+	if (earliest > m->ref_ust)
+		vblanks = (uint64_t)((earliest - m->ref_ust) / m->period_us) + 1;
+
+	uint64_t vblank = m->ref_ust + (uint64_t)(vblanks * m->period_us);
+
+	// Nor before the vblank the next swap will target, behind the queued
+	// frames, as computed in WSEGL_SwapDrawable
+	uint64_t target_msc;
+
+	if (drawable->present_mode == DRI3WS_PRESENT_MODE_MAILBOX)
+		target_msc = drawable->msc + drawable->swap_interval;
+	else
+		target_msc = drawable->msc +
+			drawable->swap_interval * (drawable->send_sbc + 1 - drawable->recv_sbc);
+
+	if (target_msc > m->ref_msc)
+		vblank = MAX(vblank, m->ref_ust + (uint64_t)((target_msc - m->ref_msc) * m->period_us));
+
+	*next_vblank_ust = vblank;
+	*render_start_ust = MAX(vblank - render_us, now);
+
+	unlock_drawable(drawable);
+
+	return true;
+}
+
+DRI3WS_EXPORT bool dri3ws_set_max_frames_in_flight(Display *dpy, Window window, unsigned max)
+{
+	struct driws_drawable *drawable = lock_drawable(dpy, window);
+
+	if (!drawable)
+		return false;
+
+	drawable->max_frames_in_flight = MIN(max, DRI3WS_MAX_BUFFERS);
+
+	unlock_drawable(drawable);
+
+	return true;
+}
+
+DRI3WS_EXPORT int dri3ws_query_buffer_age(Display *dpy, Window window)
+{
+	struct driws_drawable *drawable = lock_drawable(dpy, window);
+	int age = 0;
+
+	if (!drawable)
+		return -1;
+
+	struct driws_buffer *buffer = drawable->buffers[drawable->current_back_idx];
+
+	// The next frame will be send_sbc + 1
+	if (buffer && buffer->last_sbc)
+		age = drawable->send_sbc + 1 - buffer->last_sbc;
+
+	unlock_drawable(drawable);
+
+	return age;
+}
+
+DRI3WS_EXPORT bool dri3ws_set_damage_region(Display *dpy, Window window, const int *rects, int n_rects)
+{
+	struct driws_drawable *drawable = lock_drawable(dpy, window);
+
+	if (!drawable)
+		return false;
+
+	drawable->num_damage_rects = 0;
+
+	// Without XFixes every swap has full damage
+	if (!drawable->display->has_xfixes || n_rects <= 0) {
+		unlock_drawable(drawable);
+		return true;
+	}
+
+	int32_t w = drawable->width;
+	int32_t h = drawable->height;
+	int32_t x1 = w, y1 = h, x2 = 0, y2 = 0;
+
+	for (int i = 0; i < n_rects; ++i) {
+		const int *r = &rects[i * 4];
+
+		// Flip to the X origin at the top left and clip to the window
+		int32_t rx1 = CLAMP(r[0], 0, w);
+		int32_t rx2 = CLAMP(r[0] + r[2], 0, w);
+		int32_t ry1 = CLAMP(h - (r[1] + r[3]), 0, h);
+		int32_t ry2 = CLAMP(h - r[1], 0, h);
+
+		if (rx1 >= rx2 || ry1 >= ry2)
+			continue;
+
+		x1 = MIN(x1, rx1);
+		y1 = MIN(y1, ry1);
+		x2 = MAX(x2, rx2);
+		y2 = MAX(y2, ry2);
+
+		if (n_rects > DRI3WS_MAX_DAMAGE_RECTS)
+			continue;
+
+		xcb_rectangle_t *xr = &drawable->damage_rects[drawable->num_damage_rects++];
+		xr->x = rx1;
+		xr->y = ry1;
+		xr->width = rx2 - rx1;
+		xr->height = ry2 - ry1;
+	}
+
+	if (x1 >= x2 || y1 >= y2) {
+		// Nothing visible changed, present an empty update region
+		drawable->damage_rects[0] = (xcb_rectangle_t){ 0, 0, 0, 0 };
+		drawable->num_damage_rects = 1;
+	} else if (n_rects > DRI3WS_MAX_DAMAGE_RECTS) {
+		drawable->damage_rects[0] = (xcb_rectangle_t){ x1, y1, x2 - x1, y2 - y1 };
+		drawable->num_damage_rects = 1;
+	}
+
+	unlock_drawable(drawable);
+
+	return true;
+}
+
 WSEGL_EXPORT const WSEGL_FunctionTable *WSEGL_GetFunctionTablePointer(void)
 {
 	static const WSEGL_FunctionTable sFunctionTable =
@@ -25,24 +25,130 @@
 
 #pragma once
 
+#include <pthread.h>
+
 #include "helpers.h"
 #include "pvrhelpers.h"
+#include "dri3ws_ext.h"
 #include <wsegl.h>
 
 #if !defined(DRI3WS_USE_DUMB) && !defined(DRI3WS_USE_GBM)
 #error No BO type defined
 #endif
 
+// Buckets of a display's buffer index, a power of two
+#define DRI3WS_BUFFER_HASH_SIZE 64
+
+// Number of idle buffers kept for reuse, overridden by DRI3WS_POOL_SIZE
+#define DRI3WS_DEFAULT_POOL_SIZE 6
+
+// Swapchain depth limits, see DRI3WS_BUFFERS and DRI3WS_ADAPTIVE_BUFFERS
+#define DRI3WS_MIN_BUFFERS 2
+#define DRI3WS_MAX_BUFFERS 8
+#define DRI3WS_DEFAULT_BUFFERS 3
+#define DRI3WS_DEFAULT_MAX_BUFFERS 4
+
+// Number of frames over which the adaptive swapchain depth is evaluated
+#define DRI3WS_ADAPT_FRAMES 60
+
+// Largest supported swap interval
+#define DRI3WS_MAX_SWAP_INTERVAL 4
+
+// Upper bound for the event thread's sleep, in case another thread reads
+// our events from the connection without waking it
+#define DRI3WS_EVENT_POLL_MS 10
+
+// Longest the event thread backs off to when its wakeups find no events
+#define DRI3WS_EVENT_POLL_MAX_MS 100
+
+// Presents whose swap time and target are remembered, indexed by SBC
+#define DRI3WS_PRESENT_HISTORY 32
+
+// Completed frames kept for timing statistics, a power of two
+#define DRI3WS_FRAME_RING_SIZE 256
+
+// Present requests whose result may be outstanding before we block on one
+#define DRI3WS_MAX_PENDING_PRESENTS 16
+
+// Consecutive copies of a fullscreen window before it gets scanout buffers,
+// see DRI3WS_SCANOUT_ALIGN
+#define DRI3WS_SCANOUT_COPY_FRAMES 3
+#define DRI3WS_DEFAULT_SCANOUT_PITCH_ALIGN 64
+
+// Consecutive skipped presents before a window is considered hidden, and
+// how often the map state of a throttled window is checked
+#define DRI3WS_HIDDEN_SKIP_FRAMES 3
+#define DRI3WS_HIDDEN_POLL_MS 100
+#define DRI3WS_DEFAULT_HIDDEN_FPS 1
+
+// Completions used to fit the vblank period and phase
+#define DRI3WS_VBLANK_SAMPLES 16
+
+// Time the server needs between a swap and the vblank it is meant for,
+// see DRI3WS_VBLANK_MARGIN_US
+#define DRI3WS_DEFAULT_VBLANK_MARGIN_US 2000
+
+// Imported pixmaps kept for reuse after their drawables are deleted
+#define DRI3WS_IMPORT_CACHE_SIZE 8
+
+// Damage rectangles kept per swap, more are merged into their bounding box
+#define DRI3WS_MAX_DAMAGE_RECTS 16
+
 enum driws_drawable_type {
 	DRI3WS_DRAWABLE_UNKNOWN = 0,
 	DRI3WS_DRAWABLE_WINDOW = 1,
 	DRI3WS_DRAWABLE_PIXMAP = 2,
 };
 
+struct driws_buffer;
+
+/*
+ * Allocation parameters of a buffer. Buffers with equal keys are
+ * interchangeable, which is what the buffer pool matches on.
+ */
+struct driws_buffer_key {
+	uint32_t width;
+	uint32_t height;
+	WSEGLPixelFormat format;
+	uint32_t stride;	/* requested stride in bytes */
+	bool scanout;		/* allocated for direct scanout */
+};
+
+/*
+ * Display-wide pool of idle buffers, kept in LRU order. Buffers released by
+ * a drawable end up here and are handed out again to the next allocation
+ * with a matching key, avoiding the BO allocation, PVR mapping and pixmap
+ * creation.
+ */
+struct driws_buffer_pool {
+	struct driws_buffer *head;	/* most recently released */
+	struct driws_buffer *tail;	/* least recently released */
+
+	uint32_t count;
+	uint32_t max_count;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+};
+
+/*
+ * Optional thread servicing the Present events of all drawables on a
+ * display, so that render threads only sleep on display->event_cond.
+ */
+struct driws_event_thread {
+	pthread_t thread;
+	int wake_fd;	/* eventfd to interrupt the thread's poll() */
+
+	bool running;
+	bool quit;
+};
+
 struct driws_display {
 	struct driws_display *next;
 
-	struct pvr_data pvr_data;
+	// Shared by all displays of the process
+	struct pvr_data *pvr_data;
 
 	uint32_t ref_count;
 
@@ -57,14 +163,107 @@ struct driws_display {
 #endif
 
 	WSEGLConfig wsegl_configs[4];
+
+	struct driws_buffer_pool pool;
+
+	/*
+	 * Index of the display's buffers by pixmap XID, chained through
+	 * driws_buffer::next. XIDs from one client are allocated
+	 * sequentially, so the low bits spread well over the buckets.
+	 */
+	struct driws_buffer *buffer_hash[DRI3WS_BUFFER_HASH_SIZE];
+
+	/*
+	 * Buffers dropped from a swapchain while the server still uses them.
+	 * They are released when their IdleNotify arrives.
+	 */
+	struct driws_buffer *retired;
+
+	struct driws_drawable *drawables;
+
+	// Pixmaps imported for rendering, most recently used first
+	struct driws_import *imports;
+	uint32_t num_idle_imports;
+
+	// Triggers the wait fences of buffers once rendering has finished
+	struct pvr_completion_service completions;
+
+	/*
+	 * Protects the display's buffer lists and the event driven state of
+	 * its drawables. event_cond is signalled when events have been
+	 * handled by the event thread.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t event_cond;
+
+	struct driws_event_thread event_thread;
+
+	// Whether the server accepts xshmfences, probed on first use
+	bool shm_fence_checked;
+	bool shm_fence_supported;
+
+	// XFixes regions can be used for damage
+	bool has_xfixes;
+
+	// Time reserved for the server when predicting vblanks
+	uint32_t vblank_margin_us;
+
+	// Bound of a swap's wait for rendering, 0 for none, and the time
+	// spent polling before sleeping
+	uint64_t gpu_wait_timeout_us;
+	uint32_t gpu_spin_us;
+
+	// Pitch alignment of scanout buffers in bytes, 0 disables them
+	uint32_t scanout_pitch_align;
+
+	// Copy to pixmaps through their mapping instead of by the server
+	bool copy_cpu;
 };
 
 struct driws_drawable;
 
+/*
+ * Storage of an X pixmap, imported with DRI3 BufferFromPixmap and mapped
+ * so that it can be rendered to in place. Imports are cached per XID and
+ * checked against the pixmap's geometry when reused, as the XID may have
+ * been freed and reused meanwhile.
+ */
+struct driws_import {
+	struct driws_import *next;
+	struct driws_display *display;
+
+	xcb_pixmap_t pixmap;
+	uint32_t width;
+	uint32_t height;
+	uint32_t depth;
+	uint32_t bpp;
+	uint32_t stride_bytes;
+	uint32_t size;
+
+	int dmabuf_fd;
+	PVRSRV_CLIENT_MEM_INFO *pvr_meminfo;
+	void *mmap;
+
+	// Pixmap drawables using the import, and whether it is in the cache
+	uint32_t refs;
+	bool cached;
+};
+
 struct driws_buffer {
 	struct driws_buffer *next;
 
-	struct driws_drawable *drawable;
+	struct driws_display *display;
+	struct driws_drawable *drawable;	/* NULL while in the pool */
+
+	struct driws_buffer_key key;
+
+	/* links in the display's buffer pool */
+	struct driws_buffer *pool_prev;
+	struct driws_buffer *pool_next;
+
+	/* link in the display's retirement queue */
+	struct driws_buffer *retired_next;
+	bool retired;
 
 	void *mmap;
 	PVRSRV_CLIENT_MEM_INFO *pvr_meminfo;
@@ -86,9 +285,68 @@ struct driws_buffer {
 #endif
 
 	bool busy;
+
+	// SBC of the latest present of the buffer, 0 if its contents are undefined
+	uint64_t last_sbc;
+
+	/*
+	 * Fence the server waits on before using the buffer, triggered by
+	 * the display's completion service when rendering has finished
+	 */
+	struct xshmfence *wait_shm;
+	xcb_sync_fence_t wait_fence;
+	struct pvr_completion wait_completion;
+
+	// Fence the server triggers when it is done with the buffer
+	struct xshmfence *idle_shm;
+	xcb_sync_fence_t idle_fence;
+};
+
+/*
+ * A present request sent without waiting for its result
+ */
+struct driws_present_request {
+	unsigned int sequence;
+	xcb_pixmap_t pixmap;
+	uint64_t sbc;
+};
+
+/*
+ * Ring of completed frames. It has a single writer, the Present event
+ * handler, which publishes each record by advancing head. Readers copy
+ * records without locking and use head to detect ones overwritten
+ * meanwhile.
+ */
+struct driws_frame_ring {
+	struct dri3ws_frame_record records[DRI3WS_FRAME_RING_SIZE];
+	uint64_t head;	/* number of records ever written */
+};
+
+/*
+ * Vblank timing of the CRTC a window is shown on, fitted to the UST/MSC
+ * pairs of its recent completions. ref_ust is the fitted time of vblank
+ * ref_msc.
+ */
+struct driws_vblank_model {
+	uint64_t msc[DRI3WS_VBLANK_SAMPLES];
+	uint64_t ust[DRI3WS_VBLANK_SAMPLES];
+	uint32_t count;
+	uint32_t head;
+
+	bool valid;
+	uint64_t ref_msc;
+	uint64_t ref_ust;
+	double period_us;
+};
+
+struct driws_present_info {
+	uint64_t swap_ust;
+	uint64_t target_msc;
 };
 
 struct driws_drawable {
+	struct driws_drawable *next;
+
 	struct driws_display *display;
 	xcb_window_t xcb_window;
 
@@ -98,11 +356,116 @@ struct driws_drawable {
 	WSEGLPixelFormat wsegl_pixel_format;
 
 	uint32_t current_back_idx;
-	struct driws_buffer *buffers[3];
+	uint32_t num_buffers;
+	struct driws_buffer *buffers[DRI3WS_MAX_BUFFERS];
+
+	/*
+	 * Adaptive swapchain depth. Over each window of DRI3WS_ADAPT_FRAMES
+	 * frames we count the frames that had to wait for an idle back
+	 * buffer, and the smallest number of idle buffers left over when
+	 * a back buffer was handed out.
+	 */
+	bool adaptive;
+	uint32_t min_buffers;
+	uint32_t max_buffers;
+	uint32_t adapt_frames;
+	uint32_t adapt_blocked;
+	uint32_t adapt_min_spare;
 
 	enum driws_drawable_type drawable_type;
 
 	xcb_special_event_t* special_ev;
 
+	// Storage of a pixmap drawable
+	struct driws_import *import;
+
 	bool size_changed;
+
+	uint32_t swap_interval;
+
+	enum dri3ws_present_mode present_mode;
+
+	// Presents that may await completion when swap returns, 0 for no limit
+	uint32_t max_frames_in_flight;
+
+	/*
+	 * Completion mode of the latest present and the number of
+	 * consecutive copies. Fullscreen windows that keep being copied are
+	 * reallocated with scanout buffers, which the server can flip, until
+	 * they are resized to no longer be fullscreen.
+	 */
+	uint8_t complete_mode;
+	uint32_t copy_frames;
+	bool scanout;
+	bool scanout_pending;
+
+	/*
+	 * With hidden_throttle, swaps of a window that is unmapped, or whose
+	 * presents the server keeps skipping, are throttled to hidden_fps.
+	 * If hidden_fps is 0, an unmapped window blocks until it is mapped
+	 * and a skipped one is throttled to DRI3WS_DEFAULT_HIDDEN_FPS.
+	 * The map state is polled, at the latest DRI3WS_HIDDEN_POLL_MS after
+	 * the last check, or at the next swap after a skip.
+	 */
+	bool hidden_throttle;
+	uint32_t skip_frames;
+	bool hidden;
+	bool unmapped;
+	bool check_mapped;
+	uint64_t map_check_us;
+	uint32_t hidden_fps;
+	uint64_t hidden_swap_us;
+
+	// Let the server wait for rendering instead of blocking in swap
+	bool use_wait_fence;
+
+	// Track buffer release with idle fences instead of IdleNotify events
+	bool use_idle_fence;
+
+	/*
+	 * Swap counters: send_sbc counts presents sent and recv_sbc those
+	 * completed. msc is the MSC of the latest completion.
+	 */
+	uint64_t send_sbc;
+	uint64_t recv_sbc;
+	uint64_t msc;
+
+	/* ring of present requests whose errors have not been collected */
+	struct driws_present_request pending_presents[DRI3WS_MAX_PENDING_PRESENTS];
+	uint32_t pending_head;
+	uint32_t pending_count;
+
+	/*
+	 * Damage for the next swap in X coordinates, none for full damage.
+	 * The region is created on first use and updated for every damaged
+	 * swap.
+	 */
+	xcb_rectangle_t damage_rects[DRI3WS_MAX_DAMAGE_RECTS];
+	uint32_t num_damage_rects;
+	xcb_xfixes_region_t damage_region;
+
+	uint64_t frames;
+	uint64_t round_trips;	/* blocking X requests made for this drawable */
+	uint64_t damaged_frames;
+	uint64_t damage_bytes_saved;	/* window bytes not copied thanks to damage */
+	uint64_t throttled_frames;	/* swaps that waited for max_frames_in_flight */
+	uint64_t hidden_frames;		/* swaps throttled while hidden */
+	uint64_t gpu_wait_loops;
+	uint64_t gpu_wait_spurious;
+	uint64_t gpu_wait_us;
+	uint64_t gpu_wait_timeouts;
+	uint32_t max_queue_depth;
+
+	struct driws_vblank_model vblank;
+
+	/*
+	 * Start of the current frame from FlagStartFrame, and the smoothed
+	 * time from there until rendering finished and its mean deviation
+	 */
+	uint64_t frame_start_us;
+	uint64_t render_avg_us;
+	uint64_t render_dev_us;
+
+	struct driws_present_info presents[DRI3WS_PRESENT_HISTORY];
+	struct driws_frame_ring frame_ring;
 };
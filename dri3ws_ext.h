@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2017 Texas Instruments Incorporated.
+ *
+ * The contents of this file are subject to the MIT license as set out below.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * DRI3WSEGL extensions
+ *
+ * Functions exported from libpvrDRI3WSEGL.so in addition to the WSEGL
+ * function table. The library is loaded by the PVR EGL implementation, so
+ * applications normally look these up with dlsym().
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <X11/Xlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DRI3WS_EXPORT __attribute__((visibility("default")))
+
+struct dri3ws_pool_stats {
+	uint32_t buffers;	/* idle buffers currently in the pool */
+	uint32_t max_buffers;	/* pool size limit */
+	uint64_t hits;		/* allocations served from the pool */
+	uint64_t misses;	/* allocations that created a new buffer */
+	uint64_t evictions;	/* buffers destroyed because the pool was full */
+};
+
+/* Returns false if dpy has not been initialised by EGL */
+DRI3WS_EXPORT bool dri3ws_get_pool_stats(Display *dpy, struct dri3ws_pool_stats *stats);
+
+struct dri3ws_swap_stats {
+	uint64_t frames;	/* frames presented */
+	uint64_t round_trips;	/* blocking X requests, e.g. on (re)allocation */
+	uint64_t damaged_frames;	/* frames presented with a damage region */
+	uint64_t damage_bytes_saved;	/* bytes outside the damage, not copied */
+	uint64_t throttled_frames;	/* swaps that waited for the frames in flight limit */
+	uint64_t hidden_frames;		/* swaps throttled while the window was hidden */
+	uint64_t gpu_wait_loops;	/* sleeps on the SGX event object in swaps */
+	uint64_t gpu_wait_spurious;	/* of which woken by other rendering */
+	uint64_t gpu_wait_us;		/* time swaps waited for rendering */
+	uint64_t gpu_wait_timeouts;	/* swaps that returned WSEGL_RETRY */
+	uint32_t queue_depth;		/* presents not yet completed */
+	uint32_t max_queue_depth;	/* largest queue_depth seen after a swap */
+};
+
+/* Returns false if window is not an EGL window surface on dpy */
+DRI3WS_EXPORT bool dri3ws_get_swap_stats(Display *dpy, Window window, struct dri3ws_swap_stats *stats);
+
+/* Completion modes, as reported by Present */
+enum dri3ws_complete_mode {
+	DRI3WS_COMPLETE_COPY = 0,
+	DRI3WS_COMPLETE_FLIP = 1,
+	DRI3WS_COMPLETE_SKIP = 2,
+};
+
+/* Timing of one completed frame. Times are CLOCK_MONOTONIC microseconds. */
+struct dri3ws_frame_record {
+	uint64_t sbc;		/* swap count of the frame */
+	uint64_t swap_ust;	/* when the frame was swapped */
+	uint64_t complete_ust;	/* when the frame was shown */
+	uint64_t target_msc;	/* vblank the frame was meant for, 0 for ASAP */
+	uint64_t msc;		/* vblank the frame was shown on */
+	uint32_t mode;		/* enum dri3ws_complete_mode */
+};
+
+#define DRI3WS_FRAME_HISTOGRAM_SIZE 8
+
+/* Summary of the most recent frames of a window */
+struct dri3ws_frame_stats {
+	uint32_t frames;
+	uint32_t flips;
+	uint32_t copies;
+	uint32_t skips;
+	uint32_t late_frames;	/* shown frames that missed their target vblank */
+	uint64_t latency_avg_us;	/* swap to completion */
+	uint64_t latency_max_us;
+	/* shown frames by vblanks since the previous shown frame, the
+	 * last bucket counts all longer intervals. Skipped frames are
+	 * only counted in skips. */
+	uint32_t interval_histogram[DRI3WS_FRAME_HISTOGRAM_SIZE];
+};
+
+DRI3WS_EXPORT bool dri3ws_get_frame_stats(Display *dpy, Window window, struct dri3ws_frame_stats *stats);
+
+/* Copy up to max of the most recent frame records, oldest first. Returns
+ * the number of records copied. */
+DRI3WS_EXPORT unsigned dri3ws_get_frame_records(Display *dpy, Window window,
+						struct dri3ws_frame_record *records, unsigned max);
+
+/* How a window's presents are queued */
+enum dri3ws_present_mode {
+	/* Every frame is shown, in order */
+	DRI3WS_PRESENT_MODE_FIFO = 0,
+	/* A frame not yet shown is replaced by a newer one, and its buffer
+	 * is released right away */
+	DRI3WS_PRESENT_MODE_MAILBOX = 1,
+};
+
+/* Takes effect from the next swap. Returns false if window is not an EGL
+ * window surface on dpy. */
+DRI3WS_EXPORT bool dri3ws_set_present_mode(Display *dpy, Window window, enum dri3ws_present_mode mode);
+
+/*
+ * Predict the next vblank of window that a frame started now can be shown
+ * on, from the timing of recent frames, the swap interval and the frames
+ * already queued, and when rendering of it should start, so that input can
+ * be sampled as late as possible. Times are
+ * CLOCK_MONOTONIC microseconds. Returns false if window is not an EGL
+ * window surface on dpy or not enough frames have been shown yet.
+ */
+DRI3WS_EXPORT bool dri3ws_predict_vblank(Display *dpy, Window window,
+					 uint64_t *next_vblank_ust, uint64_t *render_start_ust);
+
+/*
+ * Limit the presents of window not yet shown (completed) when a swap
+ * returns, bounding the latency from the start of rendering a frame to its
+ * display. 0 removes the limit. Returns false if window is not an EGL
+ * window surface on dpy.
+ */
+DRI3WS_EXPORT bool dri3ws_set_max_frames_in_flight(Display *dpy, Window window, unsigned max);
+
+/*
+ * Age of the back buffer of window, like EGL_EXT_buffer_age: 1 if it holds
+ * the previous frame, 2 for the one before and so on, or 0 if its contents
+ * are undefined, e.g. after a resize. Call it after EGL has made the
+ * surface current or swapped it. Returns -1 if window is not an EGL window
+ * surface on dpy.
+ */
+DRI3WS_EXPORT int dri3ws_query_buffer_age(Display *dpy, Window window);
+
+/*
+ * Set the damage of the next swap of window, like
+ * EGL_KHR_swap_buffers_with_damage. rects holds n_rects rectangles as
+ * x, y, width, height with the origin at the bottom left. The whole
+ * buffer must still be rendered; the damage only limits what the X server
+ * copies. It is not used when the frame is flipped, and is dropped after
+ * the swap. Returns false if window is not an EGL window surface on dpy.
+ */
+DRI3WS_EXPORT bool dri3ws_set_damage_region(Display *dpy, Window window, const int *rects, int n_rects);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2017 Texas Instruments Incorporated.
+ *
+ * The contents of this file are subject to the MIT license as set out below.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Loads the DRI3WSEGL plugin like EGL does and drives its function table
+ * directly from several threads, each swapping its own window, to measure
+ * how swap throughput scales with the number of threads. No rendering is
+ * done, so this measures the plugin and X server overhead only.
+ *
+ * With -c it instead measures eglCopyBuffers, copying a window to a pixmap
+ * at typical window sizes with both the X server and the CPU.
+ */
+
+#include <X11/Xlib.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef Display *NativeDisplayType;
+typedef Window NativeWindowType;
+typedef Pixmap NativePixmapType;
+
+#include <wsegl.h>
+
+#define FAIL(fmt, ...) \
+	do { \
+	fprintf(stderr, "%s:%d: %s:\n" fmt "\n", __FILE__, __LINE__, __PRETTY_FUNCTION__, ##__VA_ARGS__); \
+	abort(); \
+	} while(0)
+
+#define FAIL_IF(x, fmt, ...) \
+	if (x) { \
+	fprintf(stderr, "%s:%d: %s:\n" fmt "\n", __FILE__, __LINE__, __PRETTY_FUNCTION__, ##__VA_ARGS__); \
+	abort(); \
+	}
+
+#define MAX_THREADS 64
+
+static const WSEGL_FunctionTable *s_wsegl;
+static WSEGLDisplayHandle s_display;
+static WSEGLConfig *s_config;
+
+static unsigned s_width = 256;
+static unsigned s_height = 256;
+
+struct bench_thread
+{
+	pthread_t thread;
+	Window window;
+	uint64_t swaps;
+	volatile bool *stop;
+};
+
+static uint64_t get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *bench_thread_main(void *data)
+{
+	struct bench_thread *t = data;
+	WSEGLDrawableHandle drawable;
+	WSEGLRotationAngle rotation;
+	WSEGLError err;
+
+	err = s_wsegl->pfnWSEGL_CreateWindowDrawable(s_display, s_config, &drawable, t->window, &rotation);
+	FAIL_IF(err, "CreateWindowDrawable failed: %d", err);
+
+	// Don't let vblanks limit the rate
+	s_wsegl->pfnWSEGL_SwapControlInterval(drawable, 0);
+
+	while (!*t->stop) {
+		WSEGLDrawableParams source, render;
+
+		err = s_wsegl->pfnWSEGL_GetDrawableParameters(drawable, &source, &render, 0);
+		FAIL_IF(err, "GetDrawableParameters failed: %d", err);
+
+		s_wsegl->pfnWSEGL_FlagStartFrame(drawable);
+
+		do
+			err = s_wsegl->pfnWSEGL_SwapDrawable(drawable, 0);
+		while (err == WSEGL_RETRY);
+		FAIL_IF(err, "SwapDrawable failed: %d", err);
+
+		t->swaps++;
+	}
+
+	s_wsegl->pfnWSEGL_DeleteDrawable(drawable);
+
+	return NULL;
+}
+
+static double run(Display *dpy, unsigned num_threads, unsigned seconds)
+{
+	struct bench_thread threads[MAX_THREADS] = { 0 };
+	volatile bool stop = false;
+
+	for (unsigned i = 0; i < num_threads; ++i) {
+		struct bench_thread *t = &threads[i];
+
+		t->window = XCreateSimpleWindow(dpy, DefaultRootWindow(dpy),
+						(i % 8) * s_width / 2, (i / 8) * s_height / 2,
+						s_width, s_height, 0, 0, 0);
+		XMapWindow(dpy, t->window);
+		t->stop = &stop;
+	}
+
+	XSync(dpy, False);
+
+	uint64_t start = get_time_us();
+
+	for (unsigned i = 0; i < num_threads; ++i) {
+		int r = pthread_create(&threads[i].thread, NULL, bench_thread_main, &threads[i]);
+		FAIL_IF(r, "pthread_create failed");
+	}
+
+	sleep(seconds);
+
+	stop = true;
+
+	uint64_t swaps = 0;
+
+	for (unsigned i = 0; i < num_threads; ++i) {
+		pthread_join(threads[i].thread, NULL);
+		swaps += threads[i].swaps;
+	}
+
+	uint64_t elapsed = get_time_us() - start;
+
+	for (unsigned i = 0; i < num_threads; ++i)
+		XDestroyWindow(dpy, threads[i].window);
+
+	XSync(dpy, False);
+
+	return swaps * 1000000.0 / elapsed;
+}
+
+static bool open_plugin_display(Display *dpy)
+{
+	const WSEGLCaps *caps;
+	WSEGLConfig *configs;
+
+	WSEGLError err = s_wsegl->pfnWSEGL_InitialiseDisplay(dpy, &s_display, &caps, &configs);
+	FAIL_IF(err, "InitialiseDisplay failed: %d", err);
+
+	bool unlocked = false;
+
+	for (const WSEGLCaps *c = caps; c->eCapsType != WSEGL_NO_CAPS; ++c)
+		if (c->eCapsType == WSEGL_CAP_UNLOCKED)
+			unlocked = c->ui32CapsValue;
+
+	s_config = NULL;
+
+	for (WSEGLConfig *c = configs; c->ui32DrawableType != WSEGL_NO_DRAWABLE; ++c) {
+		if (c->ui32DrawableType & WSEGL_DRAWABLE_WINDOW) {
+			s_config = c;
+			break;
+		}
+	}
+	FAIL_IF(!s_config, "no window config");
+
+	return unlocked;
+}
+
+static double run_copy(Display *dpy, unsigned width, unsigned height, unsigned seconds)
+{
+	WSEGLDrawableHandle drawable;
+	WSEGLDrawableParams source, render;
+	WSEGLRotationAngle rotation;
+	WSEGLError err;
+
+	unsigned depth = s_config->ePixelFormat == WSEGL_PIXELFORMAT_RGB565 ? 16 : 24;
+
+	Window window = XCreateSimpleWindow(dpy, DefaultRootWindow(dpy), 0, 0, width, height, 0, 0, 0);
+	XMapWindow(dpy, window);
+
+	Pixmap pixmap = XCreatePixmap(dpy, DefaultRootWindow(dpy), width, height, depth);
+
+	XSync(dpy, False);
+
+	err = s_wsegl->pfnWSEGL_CreateWindowDrawable(s_display, s_config, &drawable, window, &rotation);
+	FAIL_IF(err, "CreateWindowDrawable failed: %d", err);
+
+	err = s_wsegl->pfnWSEGL_GetDrawableParameters(drawable, &source, &render, 0);
+	FAIL_IF(err, "GetDrawableParameters failed: %d", err);
+
+	uint64_t copies = 0;
+	uint64_t start = get_time_us();
+	uint64_t end = start + seconds * 1000000ull;
+	uint64_t now;
+
+	// Wait for each copy, as eglCopyBuffers users would
+	do {
+		err = s_wsegl->pfnWSEGL_CopyFromDrawable(drawable, pixmap);
+		FAIL_IF(err, "CopyFromDrawable failed: %d", err);
+
+		XSync(dpy, False);
+
+		copies++;
+		now = get_time_us();
+	} while (now < end);
+
+	s_wsegl->pfnWSEGL_DeleteDrawable(drawable);
+
+	XFreePixmap(dpy, pixmap);
+	XDestroyWindow(dpy, window);
+	XSync(dpy, False);
+
+	return copies * 1000000.0 / (now - start);
+}
+
+static void copy_bench(Display *dpy, unsigned seconds)
+{
+	static const unsigned sizes[][2] = {
+		{ 320, 240 }, { 640, 480 }, { 1280, 720 }, { 1920, 1080 },
+	};
+
+	for (int cpu = 0; cpu < 2; ++cpu) {
+		// The plugin reads this when the display is initialised
+		setenv("DRI3WS_COPY_CPU", cpu ? "1" : "0", 1);
+
+		open_plugin_display(dpy);
+
+		unsigned bytespp = s_config->ePixelFormat == WSEGL_PIXELFORMAT_RGB565 ? 2 : 4;
+
+		for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+			unsigned w = sizes[i][0], h = sizes[i][1];
+			double rate = run_copy(dpy, w, h, seconds);
+
+			printf("%s %4ux%-4u: %8.1f copies/s, %7.1f MB/s\n", cpu ? "cpu   " : "server",
+			       w, h, rate, rate * w * h * bytespp / 1000000);
+		}
+
+		s_wsegl->pfnWSEGL_CloseDisplay(s_display);
+	}
+}
+
+static void usage(void)
+{
+	puts("Usage: dri3wsbench [-c] [-t max-threads] [-s seconds] [-p plugin] [-w width] [-h height]");
+}
+
+int main(int argc, char **argv)
+{
+	const char *plugin = "libpvrDRI3WSEGL.so";
+	unsigned max_threads = 4;
+	unsigned seconds = 5;
+	bool copy = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ct:s:p:w:h:")) != -1) {
+		switch (opt) {
+		case 'c':
+			copy = true; break;
+		case 't':
+			max_threads = atoi(optarg); break;
+		case 's':
+			seconds = atoi(optarg); break;
+		case 'p':
+			plugin = optarg; break;
+		case 'w':
+			s_width = atoi(optarg); break;
+		case 'h':
+			s_height = atoi(optarg); break;
+		default: /* '?' */
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (max_threads < 1 || max_threads > MAX_THREADS) {
+		fprintf(stderr, "Threads must be 1-%u\n", MAX_THREADS);
+		exit(EXIT_FAILURE);
+	}
+
+	FAIL_IF(!XInitThreads(), "XInitThreads failed");
+
+	Display *dpy = XOpenDisplay(NULL);
+	FAIL_IF(!dpy, "couldn't open display");
+
+	void *lib = dlopen(plugin, RTLD_NOW | RTLD_LOCAL);
+	FAIL_IF(!lib, "couldn't load %s: %s", plugin, dlerror());
+
+	const WSEGL_FunctionTable *(*get_table)(void) = dlsym(lib, "WSEGL_GetFunctionTablePointer");
+	FAIL_IF(!get_table, "no WSEGL_GetFunctionTablePointer in %s", plugin);
+
+	s_wsegl = get_table();
+
+	if (copy) {
+		copy_bench(dpy, seconds);
+		XCloseDisplay(dpy);
+		return 0;
+	}
+
+	bool unlocked = open_plugin_display(dpy);
+
+	printf("%ux%u windows, %s\n", s_width, s_height,
+	       unlocked ? "unlocked" : "EGL lock required, calls are still concurrent");
+
+	double base = 0;
+
+	// Powers of two up to max_threads, and max_threads itself
+	for (unsigned n = 1; ; n = n * 2 < max_threads ? n * 2 : max_threads) {
+		double rate = run(dpy, n, seconds);
+
+		if (n == 1)
+			base = rate;
+
+		printf("%2u threads: %8.1f swaps/s, %7.1f per thread, scaling %.2f\n",
+		       n, rate, rate / n, base > 0 ? rate / base : 0);
+
+		if (n == max_threads)
+			break;
+	}
+
+	s_wsegl->pfnWSEGL_CloseDisplay(s_display);
+
+	XCloseDisplay(dpy);
+
+	return 0;
+}
@@ -28,6 +28,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
@@ -64,3 +66,46 @@
 	}
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#define CLAMP(x, lo, hi) MIN(MAX(x, lo), hi)
+
+/*
+ * Read an unsigned integer tunable from the environment, returning def if
+ * the variable is not set or cannot be parsed.
+ */
+static inline unsigned env_uint(const char *name, unsigned def)
+{
+	const char *str = getenv(name);
+	char *end;
+
+	if (!str || !*str)
+		return def;
+
+	unsigned long val = strtoul(str, &end, 0);
+	if (*end || val > UINT_MAX) {
+		ERR("bad value for %s: '%s'", name, str);
+		return def;
+	}
+
+	return val;
+}
+
+/*
+ * CLOCK_MONOTONIC in microseconds, the time base of Present UST values
+ */
+static inline uint64_t get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,413 @@
+/*
+ * Copyright (c) 2017 Texas Instruments Incorporated.
+ *
+ * The contents of this file are subject to the MIT license as set out below.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "pixconv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PIXCONV_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PIXCONV_NEON
+#include <arm_neon.h>
+#endif
+
+typedef void (*pixconv_row_fn)(void *dst, const void *src, uint32_t width);
+
+struct pixconv_kernels {
+	// RGB565 to 8888 with alpha 0xff
+	pixconv_row_fn expand_565;
+	// 8888 to RGB565, dropping the low bits
+	pixconv_row_fn pack_565;
+	// XRGB8888 to ARGB8888
+	pixconv_row_fn set_alpha;
+};
+
+/* Scalar reference */
+
+static inline uint32_t expand_565_pixel(uint16_t p)
+{
+	uint32_t r = (p >> 11) & 0x1f;
+	uint32_t g = (p >> 5) & 0x3f;
+	uint32_t b = p & 0x1f;
+
+	return 0xff000000 |
+	       ((r << 3) | (r >> 2)) << 16 |
+	       ((g << 2) | (g >> 4)) << 8 |
+	       ((b << 3) | (b >> 2));
+}
+
+static inline uint16_t pack_565_pixel(uint32_t p)
+{
+	return ((p >> 8) & 0xf800) | ((p >> 5) & 0x07e0) | ((p >> 3) & 0x001f);
+}
+
+static void expand_565_scalar(void *dst, const void *src, uint32_t width)
+{
+	uint32_t *d = dst;
+	const uint16_t *s = src;
+
+	for (uint32_t i = 0; i < width; ++i)
+		d[i] = expand_565_pixel(s[i]);
+}
+
+static void pack_565_scalar(void *dst, const void *src, uint32_t width)
+{
+	uint16_t *d = dst;
+	const uint32_t *s = src;
+
+	for (uint32_t i = 0; i < width; ++i)
+		d[i] = pack_565_pixel(s[i]);
+}
+
+static void set_alpha_scalar(void *dst, const void *src, uint32_t width)
+{
+	uint32_t *d = dst;
+	const uint32_t *s = src;
+
+	for (uint32_t i = 0; i < width; ++i)
+		d[i] = s[i] | 0xff000000;
+}
+
+#ifdef PIXCONV_X86
+
+/*
+ * The 565 conversions work on 32 bit lanes. Each lane of expand holds a
+ * 565 pixel, and the components are shifted into place and their top bits
+ * replicated into the low bits, as in expand_565_pixel().
+ */
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+static inline SSE2 __m128i expand_565_sse2_lanes(__m128i p)
+{
+	__m128i r = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xf800)), 8),
+				 _mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0xe000)), 3));
+	__m128i g = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0x07e0)), 5),
+				 _mm_srli_epi32(_mm_and_si128(p, _mm_set1_epi32(0x0600)), 1));
+	__m128i b = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, _mm_set1_epi32(0x001f)), 3),
+				 _mm_srli_epi32(_mm_and_si128(p, _mm_set1_epi32(0x001c)), 2));
+
+	return _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, _mm_set1_epi32(0xff000000)));
+}
+
+static inline SSE2 __m128i pack_565_sse2_lanes(__m128i p)
+{
+	return _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0xf800)),
+					 _mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x07e0))),
+			    _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x001f)));
+}
+
+static SSE2 void expand_565_sse2(void *dst, const void *src, uint32_t width)
+{
+	uint32_t *d = dst;
+	const uint16_t *s = src;
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t i = 0;
+
+	for (; i + 8 <= width; i += 8) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(s + i));
+
+		_mm_storeu_si128((__m128i *)(d + i), expand_565_sse2_lanes(_mm_unpacklo_epi16(p, zero)));
+		_mm_storeu_si128((__m128i *)(d + i + 4), expand_565_sse2_lanes(_mm_unpackhi_epi16(p, zero)));
+	}
+
+	expand_565_scalar(d + i, s + i, width - i);
+}
+
+static SSE2 void pack_565_sse2(void *dst, const void *src, uint32_t width)
+{
+	uint16_t *d = dst;
+	const uint32_t *s = src;
+	uint32_t i = 0;
+
+	for (; i + 8 <= width; i += 8) {
+		__m128i lo = pack_565_sse2_lanes(_mm_loadu_si128((const __m128i *)(s + i)));
+		__m128i hi = pack_565_sse2_lanes(_mm_loadu_si128((const __m128i *)(s + i + 4)));
+
+		// SSE2 only packs with signed saturation, so sign extend first
+		lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+		hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+
+		_mm_storeu_si128((__m128i *)(d + i), _mm_packs_epi32(lo, hi));
+	}
+
+	pack_565_scalar(d + i, s + i, width - i);
+}
+
+static SSE2 void set_alpha_sse2(void *dst, const void *src, uint32_t width)
+{
+	uint32_t *d = dst;
+	const uint32_t *s = src;
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	uint32_t i = 0;
+
+	for (; i + 4 <= width; i += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(s + i));
+
+		_mm_storeu_si128((__m128i *)(d + i), _mm_or_si128(p, alpha));
+	}
+
+	set_alpha_scalar(d + i, s + i, width - i);
+}
+
+static inline AVX2 __m256i expand_565_avx2_lanes(__m256i p)
+{
+	__m256i r = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0xf800)), 8),
+				    _mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0xe000)), 3));
+	__m256i g = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0x07e0)), 5),
+				    _mm256_srli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0x0600)), 1));
+	__m256i b = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0x001f)), 3),
+				    _mm256_srli_epi32(_mm256_and_si256(p, _mm256_set1_epi32(0x001c)), 2));
+
+	return _mm256_or_si256(_mm256_or_si256(r, g), _mm256_or_si256(b, _mm256_set1_epi32(0xff000000)));
+}
+
+static inline AVX2 __m256i pack_565_avx2_lanes(__m256i p)
+{
+	return _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(p, 8), _mm256_set1_epi32(0xf800)),
+					       _mm256_and_si256(_mm256_srli_epi32(p, 5), _mm256_set1_epi32(0x07e0))),
+			       _mm256_and_si256(_mm256_srli_epi32(p, 3), _mm256_set1_epi32(0x001f)));
+}
+
+static AVX2 void expand_565_avx2(void *dst, const void *src, uint32_t width)
+{
+	uint32_t *d = dst;
+	const uint16_t *s = src;
+	uint32_t i = 0;
+
+	for (; i + 16 <= width; i += 16) {
+		__m256i lo = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(s + i)));
+		__m256i hi = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(s + i + 8)));
+
+		_mm256_storeu_si256((__m256i *)(d + i), expand_565_avx2_lanes(lo));
+		_mm256_storeu_si256((__m256i *)(d + i + 8), expand_565_avx2_lanes(hi));
+	}
+
+	expand_565_scalar(d + i, s + i, width - i);
+}
+
+static AVX2 void pack_565_avx2(void *dst, const void *src, uint32_t width)
+{
+	uint16_t *d = dst;
+	const uint32_t *s = src;
+	uint32_t i = 0;
+
+	for (; i + 16 <= width; i += 16) {
+		__m256i lo = pack_565_avx2_lanes(_mm256_loadu_si256((const __m256i *)(s + i)));
+		__m256i hi = pack_565_avx2_lanes(_mm256_loadu_si256((const __m256i *)(s + i + 8)));
+
+		// packus works within 128 bit halves, so put the quadwords back in order
+		__m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xd8);
+
+		_mm256_storeu_si256((__m256i *)(d + i), p);
+	}
+
+	pack_565_scalar(d + i, s + i, width - i);
+}
+
+static AVX2 void set_alpha_avx2(void *dst, const void *src, uint32_t width)
+{
+	uint32_t *d = dst;
+	const uint32_t *s = src;
+	const __m256i alpha = _mm256_set1_epi32(0xff000000);
+	uint32_t i = 0;
+
+	for (; i + 8 <= width; i += 8) {
+		__m256i p = _mm256_loadu_si256((const __m256i *)(s + i));
+
+		_mm256_storeu_si256((__m256i *)(d + i), _mm256_or_si256(p, alpha));
+	}
+
+	set_alpha_scalar(d + i, s + i, width - i);
+}
+
+#endif /* PIXCONV_X86 */
+
+#ifdef PIXCONV_NEON
+
+/*
+ * NEON works on planes of 8 bit components, which vld4/vst4 split and
+ * interleave. vsri replicates the top bits of a component into its low
+ * bits, and packs components into 565.
+ */
+
+static void expand_565_neon(void *dst, const void *src, uint32_t width)
+{
+	uint32_t *d = dst;
+	const uint16_t *s = src;
+	uint32_t i = 0;
+
+	for (; i + 8 <= width; i += 8) {
+		uint16x8_t p = vld1q_u16(s + i);
+		uint8x8x4_t argb;
+
+		uint8x8_t r = vshrn_n_u16(p, 8);
+		uint8x8_t g = vshrn_n_u16(p, 3);
+		uint8x8_t b = vmovn_u16(vshlq_n_u16(p, 3));
+
+		argb.val[0] = vsri_n_u8(b, b, 5);
+		argb.val[1] = vsri_n_u8(g, g, 6);
+		argb.val[2] = vsri_n_u8(r, r, 5);
+		argb.val[3] = vdup_n_u8(0xff);
+
+		vst4_u8((uint8_t *)(d + i), argb);
+	}
+
+	expand_565_scalar(d + i, s + i, width - i);
+}
+
+static void pack_565_neon(void *dst, const void *src, uint32_t width)
+{
+	uint16_t *d = dst;
+	const uint32_t *s = src;
+	uint32_t i = 0;
+
+	for (; i + 8 <= width; i += 8) {
+		uint8x8x4_t argb = vld4_u8((const uint8_t *)(s + i));
+
+		uint16x8_t p = vshll_n_u8(argb.val[2], 8);
+		p = vsriq_n_u16(p, vshll_n_u8(argb.val[1], 8), 5);
+		p = vsriq_n_u16(p, vshll_n_u8(argb.val[0], 8), 11);
+
+		vst1q_u16(d + i, p);
+	}
+
+	pack_565_scalar(d + i, s + i, width - i);
+}
+
+static void set_alpha_neon(void *dst, const void *src, uint32_t width)
+{
+	uint32_t *d = dst;
+	const uint32_t *s = src;
+	const uint32x4_t alpha = vdupq_n_u32(0xff000000);
+	uint32_t i = 0;
+
+	for (; i + 4 <= width; i += 4)
+		vst1q_u32(d + i, vorrq_u32(vld1q_u32(s + i), alpha));
+
+	set_alpha_scalar(d + i, s + i, width - i);
+}
+
+#endif /* PIXCONV_NEON */
+
+static const struct pixconv_kernels s_kernels[PIXCONV_NUM_IMPLS] = {
+	[PIXCONV_IMPL_SCALAR] = { expand_565_scalar, pack_565_scalar, set_alpha_scalar },
+#ifdef PIXCONV_X86
+	[PIXCONV_IMPL_SSE2] = { expand_565_sse2, pack_565_sse2, set_alpha_sse2 },
+	[PIXCONV_IMPL_AVX2] = { expand_565_avx2, pack_565_avx2, set_alpha_avx2 },
+#endif
+#ifdef PIXCONV_NEON
+	[PIXCONV_IMPL_NEON] = { expand_565_neon, pack_565_neon, set_alpha_neon },
+#endif
+};
+
+unsigned pixconv_bytespp(enum pixconv_format format)
+{
+	return format == PIXCONV_RGB565 ? 2 : 4;
+}
+
+const char *pixconv_impl_name(enum pixconv_impl impl)
+{
+	static const char *names[PIXCONV_NUM_IMPLS] = { "scalar", "sse2", "avx2", "neon" };
+
+	return impl < PIXCONV_NUM_IMPLS ? names[impl] : "unknown";
+}
+
+bool pixconv_impl_supported(enum pixconv_impl impl)
+{
+	if (impl >= PIXCONV_NUM_IMPLS || !s_kernels[impl].expand_565)
+		return false;
+
+#ifdef PIXCONV_X86
+	if (impl == PIXCONV_IMPL_SSE2)
+		return __builtin_cpu_supports("sse2");
+	if (impl == PIXCONV_IMPL_AVX2)
+		return __builtin_cpu_supports("avx2");
+#endif
+
+	return true;
+}
+
+enum pixconv_impl pixconv_best_impl(void)
+{
+	static const enum pixconv_impl order[] = {
+		PIXCONV_IMPL_AVX2, PIXCONV_IMPL_NEON, PIXCONV_IMPL_SSE2,
+	};
+
+	for (unsigned i = 0; i < sizeof(order) / sizeof(order[0]); ++i)
+		if (pixconv_impl_supported(order[i]))
+			return order[i];
+
+	return PIXCONV_IMPL_SCALAR;
+}
+
+void pixconv_convert_impl(enum pixconv_impl impl,
+			  void *dst, uint32_t dst_stride, enum pixconv_format dst_format,
+			  const void *src, uint32_t src_stride, enum pixconv_format src_format,
+			  uint32_t width, uint32_t height)
+{
+	const struct pixconv_kernels *k = &s_kernels[impl];
+	uint32_t dst_bytespp = pixconv_bytespp(dst_format);
+	uint32_t src_bytespp = pixconv_bytespp(src_format);
+	pixconv_row_fn row = NULL;
+
+	if (src_format == PIXCONV_RGB565 && dst_format != PIXCONV_RGB565)
+		row = k->expand_565;
+	else if (src_format != PIXCONV_RGB565 && dst_format == PIXCONV_RGB565)
+		row = k->pack_565;
+	else if (src_format == PIXCONV_XRGB8888 && dst_format == PIXCONV_ARGB8888)
+		row = k->set_alpha;
+
+	// Convert rows without padding in one go
+	if (dst_stride == width * dst_bytespp && src_stride == width * src_bytespp) {
+		width *= height;
+		height = 1;
+	}
+
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+
+	for (uint32_t y = 0; y < height; ++y) {
+		if (row)
+			row(d, s, width);
+		else
+			memcpy(d, s, width * dst_bytespp);
+
+		d += dst_stride;
+		s += src_stride;
+	}
+}
+
+void pixconv_convert(void *dst, uint32_t dst_stride, enum pixconv_format dst_format,
+		     const void *src, uint32_t src_stride, enum pixconv_format src_format,
+		     uint32_t width, uint32_t height)
+{
+	pixconv_convert_impl(pixconv_best_impl(), dst, dst_stride, dst_format,
+			     src, src_stride, src_format, width, height);
+}
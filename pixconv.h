@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2017 Texas Instruments Incorporated.
+ *
+ * The contents of this file are subject to the MIT license as set out below.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Pixel format conversion between the formats WSEGL configs use. Formats
+ * are native endian 16 and 32 bit pixels, and strides are in bytes.
+ * Converting to ARGB8888 from an opaque format sets alpha to 0xff.
+ */
+
+enum pixconv_format {
+	PIXCONV_RGB565,
+	PIXCONV_XRGB8888,
+	PIXCONV_ARGB8888,
+};
+
+enum pixconv_impl {
+	PIXCONV_IMPL_SCALAR,
+	PIXCONV_IMPL_SSE2,
+	PIXCONV_IMPL_AVX2,
+	PIXCONV_IMPL_NEON,
+	PIXCONV_NUM_IMPLS,
+};
+
+unsigned pixconv_bytespp(enum pixconv_format format);
+const char *pixconv_impl_name(enum pixconv_impl impl);
+bool pixconv_impl_supported(enum pixconv_impl impl);
+
+// The fastest implementation supported by the CPU
+enum pixconv_impl pixconv_best_impl(void);
+
+void pixconv_convert_impl(enum pixconv_impl impl,
+			  void *dst, uint32_t dst_stride, enum pixconv_format dst_format,
+			  const void *src, uint32_t src_stride, enum pixconv_format src_format,
+			  uint32_t width, uint32_t height);
+
+void pixconv_convert(void *dst, uint32_t dst_stride, enum pixconv_format dst_format,
+		     const void *src, uint32_t src_stride, enum pixconv_format src_format,
+		     uint32_t width, uint32_t height);
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2017 Texas Instruments Incorporated.
+ *
+ * The contents of this file are subject to the MIT license as set out below.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Checks every pixconv implementation the CPU supports against the scalar
+ * reference, then measures their throughput for each conversion at typical
+ * window sizes. Runs without X or SGX.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pixconv.h"
+
+#define FAIL_IF(x, fmt, ...) \
+	if (x) { \
+	fprintf(stderr, "%s:%d: %s:\n" fmt "\n", __FILE__, __LINE__, __PRETTY_FUNCTION__, ##__VA_ARGS__); \
+	abort(); \
+	}
+
+static const enum pixconv_format s_formats[] = {
+	PIXCONV_RGB565, PIXCONV_XRGB8888, PIXCONV_ARGB8888,
+};
+
+static const char *format_name(enum pixconv_format format)
+{
+	switch (format) {
+	case PIXCONV_RGB565: return "RGB565";
+	case PIXCONV_XRGB8888: return "XRGB8888";
+	case PIXCONV_ARGB8888: return "ARGB8888";
+	}
+
+	return "unknown";
+}
+
+static uint64_t get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void fill_random(uint8_t *p, size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+		p[i] = rand();
+}
+
+/*
+ * Convert an image of random pixels with padded strides and an unaligned
+ * source, and compare the result, padding included, with the reference.
+ */
+static bool check(enum pixconv_impl impl, enum pixconv_format dst_format, enum pixconv_format src_format,
+		  uint32_t width, uint32_t height, uint32_t pad)
+{
+	uint32_t src_stride = width * pixconv_bytespp(src_format) + pad * 4;
+	uint32_t dst_stride = width * pixconv_bytespp(dst_format) + pad * 4;
+	size_t src_size = (size_t)src_stride * height + 1;
+	size_t dst_size = (size_t)dst_stride * height;
+
+	uint8_t *src = malloc(src_size);
+	uint8_t *ref = malloc(dst_size);
+	uint8_t *dst = malloc(dst_size);
+	FAIL_IF(!src || !ref || !dst, "out of memory");
+
+	fill_random(src, src_size);
+	memset(ref, 0x5a, dst_size);
+	memset(dst, 0x5a, dst_size);
+
+	// RGB565 rows are only 2 byte aligned
+	const uint8_t *s = src + (src_format == PIXCONV_RGB565 ? 2 : 4) * (pad & 1);
+	if (s + (size_t)src_stride * height > src + src_size)
+		s = src;
+
+	pixconv_convert_impl(PIXCONV_IMPL_SCALAR, ref, dst_stride, dst_format, s, src_stride, src_format,
+			     width, height);
+	pixconv_convert_impl(impl, dst, dst_stride, dst_format, s, src_stride, src_format, width, height);
+
+	bool ok = memcmp(ref, dst, dst_size) == 0;
+
+	if (!ok)
+		fprintf(stderr, "%s %s to %s %ux%u, pad %u: mismatch\n", pixconv_impl_name(impl),
+			format_name(src_format), format_name(dst_format), width, height, pad);
+
+	free(src);
+	free(ref);
+	free(dst);
+
+	return ok;
+}
+
+/*
+ * Convert a row of known pixels with every supported implementation and
+ * compare with the expected result
+ */
+static bool check_known(const char *what, enum pixconv_format dst_format, const void *expected,
+			enum pixconv_format src_format, const void *src, uint32_t width)
+{
+	uint8_t dst[64];
+	uint32_t dst_bytes = width * pixconv_bytespp(dst_format);
+	uint32_t src_bytes = width * pixconv_bytespp(src_format);
+	bool ok = true;
+
+	for (int impl = 0; impl < PIXCONV_NUM_IMPLS; ++impl) {
+		if (!pixconv_impl_supported(impl))
+			continue;
+
+		memset(dst, 0, sizeof(dst));
+		pixconv_convert_impl(impl, dst, dst_bytes, dst_format, src, src_bytes, src_format, width, 1);
+
+		if (memcmp(dst, expected, dst_bytes)) {
+			fprintf(stderr, "%s: %s is wrong\n", pixconv_impl_name(impl), what);
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+static bool check_all(void)
+{
+	bool ok = true;
+	unsigned tests = 0;
+
+	// Exact at the extremes, with opaque alpha
+	static const uint16_t in565[] = { 0x0000, 0xffff, 0xf800, 0x07e0, 0x001f };
+	static const uint32_t exp8888[] = { 0xff000000, 0xffffffff, 0xffff0000, 0xff00ff00, 0xff0000ff };
+
+	ok &= check_known("RGB565 expansion", PIXCONV_XRGB8888, exp8888,
+			  PIXCONV_RGB565, in565, 5);
+
+	// Alpha is dropped and the low bits of each channel truncated
+	static const uint32_t in8888[] = { 0xffffffff, 0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff, 0x00070307 };
+	static const uint16_t exp565[] = { 0xffff, 0x0000, 0xf800, 0x07e0, 0x001f, 0x0000 };
+
+	ok &= check_known("RGB565 packing", PIXCONV_RGB565, exp565,
+			  PIXCONV_XRGB8888, in8888, 6);
+
+	// The undefined X byte becomes opaque alpha
+	static const uint32_t inx[] = { 0x00123456, 0x7f000000, 0xffabcdef };
+	static const uint32_t expa[] = { 0xff123456, 0xff000000, 0xffabcdef };
+
+	ok &= check_known("alpha fill", PIXCONV_ARGB8888, expa,
+			  PIXCONV_XRGB8888, inx, 3);
+
+	for (int impl = PIXCONV_IMPL_SCALAR + 1; impl < PIXCONV_NUM_IMPLS; ++impl) {
+		if (!pixconv_impl_supported(impl))
+			continue;
+
+		for (unsigned d = 0; d < 3; ++d)
+			for (unsigned s = 0; s < 3; ++s)
+				for (uint32_t w = 1; w <= 67; ++w)
+					for (uint32_t pad = 0; pad < 3; ++pad) {
+						ok &= check(impl, s_formats[d], s_formats[s], w, 5, pad);
+						tests++;
+					}
+	}
+
+	printf("%u checks against scalar: %s\n", tests, ok ? "passed" : "FAILED");
+
+	return ok;
+}
+
+static void bench(unsigned ms_per_test)
+{
+	static const uint32_t sizes[][2] = {
+		{ 640, 480 }, { 1280, 720 }, { 1920, 1080 },
+	};
+
+	for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		uint32_t w = sizes[i][0], h = sizes[i][1];
+
+		// Pad the strides like a GPU allocation would
+		uint32_t src_stride = (w * 4 + 63) & ~63u;
+		uint32_t dst_stride = src_stride;
+
+		uint8_t *src = malloc((size_t)src_stride * h);
+		uint8_t *dst = malloc((size_t)dst_stride * h);
+		FAIL_IF(!src || !dst, "out of memory");
+
+		fill_random(src, (size_t)src_stride * h);
+		memset(dst, 0, (size_t)dst_stride * h);
+
+		for (unsigned d = 0; d < 3; ++d) {
+			for (unsigned s = 0; s < 3; ++s) {
+				printf("%4ux%-4u %8s to %-8s:", w, h, format_name(s_formats[s]), format_name(s_formats[d]));
+
+				for (int impl = 0; impl < PIXCONV_NUM_IMPLS; ++impl) {
+					if (!pixconv_impl_supported(impl))
+						continue;
+
+					uint64_t frames = 0;
+					uint64_t start = get_time_us();
+					uint64_t end = start + ms_per_test * 1000;
+					uint64_t now;
+
+					do {
+						pixconv_convert_impl(impl, dst, dst_stride, s_formats[d],
+								     src, src_stride, s_formats[s], w, h);
+						frames++;
+						now = get_time_us();
+					} while (now < end);
+
+					printf(" %s %7.1f Mpix/s", pixconv_impl_name(impl),
+					       frames * w * h / (double)(now - start));
+				}
+
+				printf("\n");
+			}
+		}
+
+		free(src);
+		free(dst);
+	}
+}
+
+static void usage(void)
+{
+	puts("Usage: pixconvbench [-c] [-m milliseconds-per-test]");
+	puts("  -c  only check the implementations against the scalar reference");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned ms = 200;
+	bool check_only = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "cm:")) != -1) {
+		switch (opt) {
+		case 'c':
+			check_only = true; break;
+		case 'm':
+			ms = atoi(optarg); break;
+		default: /* '?' */
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	printf("best implementation: %s\n", pixconv_impl_name(pixconv_best_impl()));
+
+	if (!check_all())
+		return EXIT_FAILURE;
+
+	if (!check_only)
+		bench(ms);
+
+	return 0;
+}
@@ -97,39 +97,293 @@ static inline bool unsigned_greater_equal(unsigned a, unsigned b)
 }
 
 /*
- * Wait for GPU ops to complete
+ * Services are connected once per process and shared by all users, so
+ * that buffers are mapped into a single device memory context. The last
+ * release disconnects.
  */
-void WaitForOpsComplete(const struct pvr_data *pvr_data, const PVRSRV_CLIENT_SYNC_INFO *sync_info)
+static struct pvr_data s_pvr_data;
+static unsigned s_pvr_refs;
+static pthread_mutex_t s_pvr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct pvr_data *AcquireServices(void)
+{
+	struct pvr_data *pvr_data = &s_pvr_data;
+
+	pthread_mutex_lock(&s_pvr_lock);
+
+	if (!s_pvr_refs && !InitialiseServices(&s_pvr_data))
+		pvr_data = NULL;
+	else
+		s_pvr_refs++;
+
+	pthread_mutex_unlock(&s_pvr_lock);
+
+	return pvr_data;
+}
+
+void ReleaseServices(struct pvr_data *pvr_data)
+{
+	pthread_mutex_lock(&s_pvr_lock);
+
+	if (--s_pvr_refs == 0)
+		DeInitialiseServices(pvr_data);
+
+	pthread_mutex_unlock(&s_pvr_lock);
+}
+
+/*
+ * Record the ops currently pending on a sync object
+ */
+void GetSyncPoint(const PVRSRV_CLIENT_SYNC_INFO *sync_info, struct pvr_sync_point *point)
 {
 	PVRSRV_SYNC_DATA *sync = sync_info->psSyncData;
 
+	point->sync = sync;
+
 	if (!sync)
 		return;
 
-	const IMG_UINT32 wops_pending = sync->ui32WriteOpsPending;
-	const IMG_UINT32 rops_pending = sync->ui32ReadOpsPending;
-	const IMG_UINT32 rops2_pending = sync->ui32ReadOps2Pending;
+	point->wops_pending = sync->ui32WriteOpsPending;
+	point->rops_pending = sync->ui32ReadOpsPending;
+	point->rops2_pending = sync->ui32ReadOps2Pending;
+}
+
+bool IsSyncPointReached(const struct pvr_sync_point *point)
+{
+	PVRSRV_SYNC_DATA *sync = point->sync;
+
+	if (!sync)
+		return true;
 
-	DBG("wop=%u, rop=%u, rop2=%u", wops_pending, rops_pending, rops2_pending);
+	return unsigned_greater_equal(sync->ui32WriteOpsComplete, point->wops_pending) &&
+	       unsigned_greater_equal(sync->ui32ReadOpsComplete, point->rops_pending) &&
+	       unsigned_greater_equal(sync->ui32ReadOps2Complete, point->rops2_pending);
+}
+
+/*
+ * Wait for the ops recorded in a sync point to complete
+ */
+void WaitForSyncPoint(const struct pvr_data *pvr_data, const struct pvr_sync_point *point)
+{
+	DBG("wop=%u, rop=%u, rop2=%u", point->wops_pending, point->rops_pending, point->rops2_pending);
 
 	int loops = 0;
 
-	for (;;)
+	while (!IsSyncPointReached(point))
 	{
-		IMG_UINT32 wops_complete = sync->ui32WriteOpsComplete;
-		IMG_UINT32 rops_complete = sync->ui32ReadOpsComplete;
-		IMG_UINT32 rops2_complete = sync->ui32ReadOps2Complete;
-
-		if (unsigned_greater_equal(wops_complete, wops_pending) &&
-		    unsigned_greater_equal(rops_complete, rops_pending) &&
-		    unsigned_greater_equal(rops2_complete, rops2_pending))
-		{
-			break;
-		}
-
 		loops++;
 		PVRSRVEventObjectWait(pvr_data->services, pvr_data->misc_info.hOSGlobalEvent);
 	}
 
 	DBG("SGX ops completed in %d loops", loops);
 }
+
+/*
+ * Wait for the ops recorded in a sync point to complete, polling for up to
+ * spin_us first, as short waits finish sooner than a sleep on the global
+ * event object. Returns false if the point was not reached within
+ * timeout_us, 0 for no limit. stats may be NULL.
+ */
+bool WaitForSyncPointTimeout(const struct pvr_data *pvr_data, const struct pvr_sync_point *point,
+			     uint64_t timeout_us, uint32_t spin_us, struct pvr_wait_stats *stats)
+{
+	struct pvr_wait_stats s = { 0 };
+	uint64_t start = get_time_us();
+	uint64_t now = start;
+	bool reached;
+
+	while (!(reached = IsSyncPointReached(point)) && now - start < spin_us)
+		now = get_time_us();
+
+	while (!reached) {
+		if (timeout_us && now - start >= timeout_us)
+			break;
+
+		s.loops++;
+
+		// Returns after a timeout in the kernel if nothing happens
+		PVRSRV_ERROR err = PVRSRVEventObjectWait(pvr_data->services,
+							 pvr_data->misc_info.hOSGlobalEvent);
+
+		reached = IsSyncPointReached(point);
+		now = get_time_us();
+
+		if (!reached && err == PVRSRV_OK)
+			s.spurious++;
+	}
+
+	s.waited_us = now - start;
+
+	DBG("SGX ops %s in %u loops, %u spurious, %llu us", reached ? "completed" : "timed out",
+	    s.loops, s.spurious, (unsigned long long)s.waited_us);
+
+	if (stats)
+		*stats = s;
+
+	return reached;
+}
+
+/*
+ * Wait for GPU ops to complete
+ */
+void WaitForOpsComplete(const struct pvr_data *pvr_data, const PVRSRV_CLIENT_SYNC_INFO *sync_info)
+{
+	struct pvr_sync_point point;
+
+	GetSyncPoint(sync_info, &point);
+	WaitForSyncPoint(pvr_data, &point);
+}
+
+static void *completion_thread_main(void *data)
+{
+	struct pvr_completion_service *cs = data;
+
+	pthread_mutex_lock(&cs->lock);
+
+	for (;;) {
+		while (!cs->head && !cs->quit)
+			pthread_cond_wait(&cs->cond, &cs->lock);
+
+		if (!cs->head)
+			break;
+
+		// Take the reached completions off the list, keeping the order
+		struct pvr_completion *done = NULL;
+		struct pvr_completion **done_tail = &done;
+
+		for (struct pvr_completion **p = &cs->head; *p;) {
+			struct pvr_completion *c = *p;
+
+			if (!IsSyncPointReached(&c->point)) {
+				p = &c->next;
+				continue;
+			}
+
+			*p = c->next;
+			c->next = NULL;
+			*done_tail = c;
+			done_tail = &c->next;
+		}
+
+		pthread_mutex_unlock(&cs->lock);
+
+		if (!done) {
+			// A queued point reached after the check wakes us too
+			PVRSRVEventObjectWait(cs->pvr_data->services, cs->pvr_data->misc_info.hOSGlobalEvent);
+
+			pthread_mutex_lock(&cs->lock);
+			cs->wakeups++;
+			continue;
+		}
+
+		for (struct pvr_completion *c = done; c; c = c->next)
+			c->callback(c->data);
+
+		pthread_mutex_lock(&cs->lock);
+
+		for (struct pvr_completion *c = done; c;) {
+			struct pvr_completion *next = c->next;
+
+			c->next = NULL;
+			c->pending = false;
+			cs->dispatched++;
+			c = next;
+		}
+
+		pthread_cond_broadcast(&cs->cond);
+	}
+
+	pthread_mutex_unlock(&cs->lock);
+
+	return NULL;
+}
+
+void StartCompletionService(struct pvr_completion_service *cs, const struct pvr_data *pvr_data)
+{
+	if (cs->running)
+		return;
+
+	cs->pvr_data = pvr_data;
+	cs->head = NULL;
+	cs->quit = false;
+
+	pthread_mutex_init(&cs->lock, NULL);
+	pthread_cond_init(&cs->cond, NULL);
+
+	int r = pthread_create(&cs->thread, NULL, completion_thread_main, cs);
+	FAIL_IF(r, "failed to create completion thread");
+
+	cs->running = true;
+}
+
+/*
+ * Stop the service once all queued completions have been dispatched
+ */
+void StopCompletionService(struct pvr_completion_service *cs)
+{
+	if (!cs->running)
+		return;
+
+	pthread_mutex_lock(&cs->lock);
+	cs->quit = true;
+	pthread_cond_broadcast(&cs->cond);
+	pthread_mutex_unlock(&cs->lock);
+
+	pthread_join(cs->thread, NULL);
+
+	DBG("%llu completions, %llu wakeups", (unsigned long long)cs->dispatched,
+	    (unsigned long long)cs->wakeups);
+
+	pthread_cond_destroy(&cs->cond);
+	pthread_mutex_destroy(&cs->lock);
+
+	cs->running = false;
+}
+
+/*
+ * Call completion's callback once its sync point has been reached. If it
+ * has been already, the callback is called right away by the caller. A
+ * completion still being dispatched is waited for before it is queued
+ * again, see WaitForCompletion.
+ */
+void QueueCompletion(struct pvr_completion_service *cs, struct pvr_completion *completion)
+{
+	WaitForCompletion(cs, completion);
+
+	if (IsSyncPointReached(&completion->point)) {
+		completion->pending = false;
+		completion->callback(completion->data);
+		return;
+	}
+
+	pthread_mutex_lock(&cs->lock);
+
+	completion->pending = true;
+	completion->next = NULL;
+
+	struct pvr_completion **p = &cs->head;
+	while (*p)
+		p = &(*p)->next;
+	*p = completion;
+
+	pthread_cond_broadcast(&cs->cond);
+
+	pthread_mutex_unlock(&cs->lock);
+}
+
+/*
+ * Wait until completion's callback has returned. The service is done with
+ * the completion then, so it may be changed and queued again.
+ */
+void WaitForCompletion(struct pvr_completion_service *cs, struct pvr_completion *completion)
+{
+	if (!cs->running)
+		return;
+
+	pthread_mutex_lock(&cs->lock);
+
+	while (completion->pending)
+		pthread_cond_wait(&cs->cond, &cs->lock);
+
+	pthread_mutex_unlock(&cs->lock);
+}
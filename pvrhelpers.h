@@ -28,6 +28,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <pthread.h>
 
 struct pvr_data
 {
@@ -38,6 +39,78 @@ struct pvr_data
 	PVRSRV_MISC_INFO misc_info;
 };
 
+/*
+ * The pending op counts of a sync object at some point in time. The sync
+ * point is reached when all of those ops have completed.
+ */
+struct pvr_sync_point
+{
+	PVRSRV_SYNC_DATA *sync;
+	IMG_UINT32 wops_pending;
+	IMG_UINT32 rops_pending;
+	IMG_UINT32 rops2_pending;
+};
+
+/*
+ * Counters of one wait. Spurious wakeups are event object wakeups by other
+ * sync objects in the system.
+ */
+struct pvr_wait_stats
+{
+	uint32_t loops;
+	uint32_t spurious;
+	uint64_t waited_us;
+};
+
+typedef void (*pvr_completion_cb)(void *data);
+
+/*
+ * A callback to call when a sync point is reached, owned by the caller and
+ * queued on a completion service
+ */
+struct pvr_completion
+{
+	struct pvr_sync_point point;
+	pvr_completion_cb callback;
+	void *data;
+
+	struct pvr_completion *next;
+	bool pending;
+};
+
+/*
+ * Thread that waits for any number of sync points at once, sleeping on the
+ * global event object only once for all of them, and calls the callbacks of
+ * those reached. Callbacks run without the service's lock held.
+ */
+struct pvr_completion_service
+{
+	const struct pvr_data *pvr_data;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct pvr_completion *head;
+
+	bool running;
+	bool quit;
+
+	uint64_t wakeups;
+	uint64_t dispatched;
+};
+
 bool InitialiseServices(struct pvr_data *pvr_data);
 void DeInitialiseServices(struct pvr_data *pvr_data);
+struct pvr_data *AcquireServices(void);
+void ReleaseServices(struct pvr_data *pvr_data);
+void GetSyncPoint(const PVRSRV_CLIENT_SYNC_INFO *sync_info, struct pvr_sync_point *point);
+bool IsSyncPointReached(const struct pvr_sync_point *point);
+void WaitForSyncPoint(const struct pvr_data *pvr_data, const struct pvr_sync_point *point);
+bool WaitForSyncPointTimeout(const struct pvr_data *pvr_data, const struct pvr_sync_point *point,
+			     uint64_t timeout_us, uint32_t spin_us, struct pvr_wait_stats *stats);
 void WaitForOpsComplete(const struct pvr_data *pvr_data, const PVRSRV_CLIENT_SYNC_INFO *sync_info);
+void StartCompletionService(struct pvr_completion_service *cs, const struct pvr_data *pvr_data);
+void StopCompletionService(struct pvr_completion_service *cs);
+void QueueCompletion(struct pvr_completion_service *cs, struct pvr_completion *completion);
+void WaitForCompletion(struct pvr_completion_service *cs, struct pvr_completion *completion);
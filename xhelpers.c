@@ -25,8 +25,12 @@
 #include <X11/Xlib-xcb.h>
 #include <xcb/dri3.h>
 #include <xcb/present.h>
+#include <xcb/sync.h>
+#include <xcb/xfixes.h>
+#include <X11/xshmfence.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
 #include <fcntl.h>
 
 #include "xhelpers.h"
@@ -55,56 +59,79 @@ void x_get_drawable_data(xcb_connection_t *c, xcb_drawable_t x_drawable, uint32_
 	free(reply);
 }
 
-void x_check_dri3_ext(xcb_connection_t *c, xcb_screen_t *screen)
+/*
+ * Initialisation is split in two so that all requests are sent before any
+ * reply is waited for. x_init_send costs one round trip, for the extension
+ * queries, and x_init_receive one more.
+ */
+void x_init_send(xcb_connection_t *c, xcb_screen_t *screen, struct x_init_requests *req)
 {
-	xcb_prefetch_extension_data (c, &xcb_dri3_id);
-
-	const xcb_query_extension_reply_t *extension =
-			xcb_get_extension_data(c, &xcb_dri3_id);
-	FAIL_IF (!(extension && extension->present), "No DRI3");
-
-	xcb_dri3_query_version_cookie_t cookie =
-			xcb_dri3_query_version(c, XCB_DRI3_MAJOR_VERSION, XCB_DRI3_MINOR_VERSION);
-	xcb_dri3_query_version_reply_t *reply =
-			xcb_dri3_query_version_reply(c, cookie, NULL);
-	FAIL_IF(!reply, "xcb_dri3_query_version failed");
-	printf("DRI3 %u.%u\n", reply->major_version, reply->minor_version);
-	free(reply);
-}
+	xcb_prefetch_extension_data(c, &xcb_dri3_id);
+	xcb_prefetch_extension_data(c, &xcb_present_id);
+	xcb_prefetch_extension_data(c, &xcb_xfixes_id);
 
-void x_check_present_ext(xcb_connection_t *c, xcb_screen_t *screen)
-{
-	xcb_prefetch_extension_data (c, &xcb_present_id);
-
-	const xcb_query_extension_reply_t *extension =
-			xcb_get_extension_data(c, &xcb_present_id);
-	FAIL_IF (!(extension && extension->present), "No present");
-
-	xcb_present_query_version_cookie_t cookie =
-			xcb_present_query_version(c, XCB_PRESENT_MAJOR_VERSION, XCB_PRESENT_MINOR_VERSION);
-	xcb_present_query_version_reply_t *reply =
-			xcb_present_query_version_reply(c, cookie, NULL);
-	FAIL_IF(!reply, "xcb_present_query_version failed");
-	printf("present %u.%u\n", reply->major_version, reply->minor_version);
-	free(reply);
+	const xcb_query_extension_reply_t *extension;
+
+	extension = xcb_get_extension_data(c, &xcb_dri3_id);
+	FAIL_IF(!(extension && extension->present), "No DRI3");
+
+	extension = xcb_get_extension_data(c, &xcb_present_id);
+	FAIL_IF(!(extension && extension->present), "No present");
+
+	// XFixes regions are needed only for damage, so it is optional
+	extension = xcb_get_extension_data(c, &xcb_xfixes_id);
+	req->has_xfixes = extension && extension->present;
+
+	req->dri3_version = xcb_dri3_query_version(c, XCB_DRI3_MAJOR_VERSION, XCB_DRI3_MINOR_VERSION);
+	req->present_version = xcb_present_query_version(c, XCB_PRESENT_MAJOR_VERSION, XCB_PRESENT_MINOR_VERSION);
+
+	// The version query is required before any other XFixes request
+	if (req->has_xfixes)
+		req->xfixes_version = xcb_xfixes_query_version(c, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION);
+
+	req->dri3_open = xcb_dri3_open(c, screen->root, 0);
+
+	xcb_flush(c);
 }
 
-int x_dri3_open(xcb_connection_t *c, xcb_screen_t *screen)
+/*
+ * Returns the DRM fd from DRI3 open
+ */
+int x_init_receive(xcb_connection_t *c, struct x_init_requests *req)
 {
-	xcb_dri3_open_cookie_t cookie =
-			xcb_dri3_open(c, screen->root, 0);
-	xcb_dri3_open_reply_t *reply =
-			xcb_dri3_open_reply(c, cookie, NULL);
-	FAIL_IF(!reply, "dri3 open failed");
+	xcb_dri3_query_version_reply_t *dri3_reply =
+			xcb_dri3_query_version_reply(c, req->dri3_version, NULL);
+	FAIL_IF(!dri3_reply, "xcb_dri3_query_version failed");
+	printf("DRI3 %u.%u\n", dri3_reply->major_version, dri3_reply->minor_version);
+	free(dri3_reply);
+
+	xcb_present_query_version_reply_t *present_reply =
+			xcb_present_query_version_reply(c, req->present_version, NULL);
+	FAIL_IF(!present_reply, "xcb_present_query_version failed");
+	printf("present %u.%u\n", present_reply->major_version, present_reply->minor_version);
+	free(present_reply);
+
+	if (req->has_xfixes) {
+		xcb_xfixes_query_version_reply_t *xfixes_reply =
+				xcb_xfixes_query_version_reply(c, req->xfixes_version, NULL);
+
+		// Regions were added in version 2
+		req->has_xfixes = xfixes_reply && xfixes_reply->major_version >= 2;
+		free(xfixes_reply);
+	}
+
+	xcb_dri3_open_reply_t *open_reply =
+			xcb_dri3_open_reply(c, req->dri3_open, NULL);
+	FAIL_IF(!open_reply, "dri3 open failed");
 
-	int nfds = reply->nfd;
+	int nfds = open_reply->nfd;
 	FAIL_IF(nfds != 1, "bad number of fds");
 
-	int *fds = xcb_dri3_open_reply_fds(c, reply);
+	int *fds = xcb_dri3_open_reply_fds(c, open_reply);
 
 	int fd = fds[0];
 
-	free(reply);
+	free(open_reply);
 
 	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
 
@@ -113,16 +140,119 @@ int x_dri3_open(xcb_connection_t *c, xcb_screen_t *screen)
 	return fd;
 }
 
-xcb_special_event_t *x_init_special_event_queue(xcb_connection_t *c, xcb_window_t window, uint32_t *special_ev_stamp)
+/*
+ * Unlike x_get_drawable_data, accepts any depth and returns false if the
+ * drawable does not exist
+ */
+bool x_get_pixmap_geometry(xcb_connection_t *c, xcb_pixmap_t pixmap, uint32_t *width, uint32_t *height,
+			   uint32_t *depth)
+{
+	xcb_get_geometry_cookie_t cookie = xcb_get_geometry(c, pixmap);
+	xcb_get_geometry_reply_t *reply = xcb_get_geometry_reply(c, cookie, NULL);
+	if (!reply)
+		return false;
+
+	*width = reply->width;
+	*height = reply->height;
+	*depth = reply->depth;
+
+	free(reply);
+
+	return true;
+}
+
+enum x_window_state x_get_window_state(xcb_connection_t *c, xcb_window_t window)
+{
+	xcb_get_window_attributes_cookie_t cookie =
+			xcb_get_window_attributes(c, window);
+	xcb_get_window_attributes_reply_t *reply =
+			xcb_get_window_attributes_reply(c, cookie, NULL);
+	if (!reply)
+		return X_WINDOW_ERROR;
+
+	enum x_window_state state = reply->map_state == XCB_MAP_STATE_VIEWABLE ?
+				    X_WINDOW_VIEWABLE : X_WINDOW_UNMAPPED;
+
+	free(reply);
+
+	return state;
+}
+
+uint32_t x_get_present_capabilities(xcb_connection_t *c, xcb_window_t window)
+{
+	xcb_present_query_capabilities_cookie_t cookie =
+			xcb_present_query_capabilities(c, window);
+	xcb_present_query_capabilities_reply_t *reply =
+			xcb_present_query_capabilities_reply(c, cookie, NULL);
+	if (!reply)
+		return XCB_PRESENT_CAPABILITY_NONE;
+
+	uint32_t caps = reply->capabilities;
+
+	free(reply);
+
+	return caps;
+}
+
+/*
+ * Create a fence shared with the X server. The fence starts out triggered.
+ */
+xcb_sync_fence_t x_create_shm_fence(xcb_connection_t *c, xcb_drawable_t drawable, struct xshmfence **shm_fence)
+{
+	int fd = xshmfence_alloc_shm();
+	FAIL_IF(fd < 0, "xshmfence_alloc_shm failed");
+
+	struct xshmfence *shm = xshmfence_map_shm(fd);
+	FAIL_IF(!shm, "xshmfence_map_shm failed");
+
+	xshmfence_trigger(shm);
+
+	xcb_sync_fence_t fence = xcb_generate_id(c);
+
+	// xcb takes ownership of the fd
+	xcb_dri3_fence_from_fd(c, drawable, fence, true, fd);
+
+	*shm_fence = shm;
+
+	return fence;
+}
+
+/*
+ * Check that the server can import shared memory fences
+ */
+bool x_check_shm_fence(xcb_connection_t *c, xcb_drawable_t drawable)
+{
+	int fd = xshmfence_alloc_shm();
+	if (fd < 0)
+		return false;
+
+	xcb_sync_fence_t fence = xcb_generate_id(c);
+	xcb_void_cookie_t cookie = xcb_dri3_fence_from_fd_checked(c, drawable, fence, 0, fd);
+	xcb_generic_error_t *error = xcb_request_check(c, cookie);
+
+	if (error) {
+		free(error);
+		return false;
+	}
+
+	xcb_sync_destroy_fence(c, fence);
+
+	return true;
+}
+
+void x_destroy_shm_fence(xcb_connection_t *c, xcb_sync_fence_t fence, struct xshmfence *shm_fence)
+{
+	xcb_sync_destroy_fence(c, fence);
+	xshmfence_unmap_shm(shm_fence);
+}
+
+xcb_special_event_t *x_init_special_event_queue(xcb_connection_t *c, xcb_window_t window, uint32_t event_mask,
+						uint32_t *special_ev_stamp)
 {
 	uint32_t id = xcb_generate_id(c);
 	xcb_void_cookie_t cookie;
 
-	cookie = xcb_present_select_input_checked(c, id, window,
-						  XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY |
-						  XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY |
-						  XCB_PRESENT_EVENT_MASK_CONFIGURE_NOTIFY/* |
-						  XCB_PRESENT_EVENT_MASK_REDIRECT_NOTIFY*/);
+	cookie = xcb_present_select_input_checked(c, id, window, event_mask);
 	xcb_generic_error_t *error =
 			xcb_request_check(c, cookie);
 	FAIL_IF(error, "req xge failed");
@@ -25,9 +25,30 @@
 #pragma once
 
 void x_get_drawable_data(xcb_connection_t *c, xcb_drawable_t x_drawable, uint32_t *width, uint32_t *height);
-void x_check_dri3_ext(xcb_connection_t *c, xcb_screen_t *screen);
-void x_check_present_ext(xcb_connection_t *c, xcb_screen_t *screen);
-int x_dri3_open(xcb_connection_t *c, xcb_screen_t *screen);
-xcb_special_event_t *x_init_special_event_queue(xcb_connection_t *c, xcb_window_t window, uint32_t *special_ev_stamp);
+struct x_init_requests {
+	xcb_dri3_query_version_cookie_t dri3_version;
+	xcb_present_query_version_cookie_t present_version;
+	xcb_xfixes_query_version_cookie_t xfixes_version;
+	xcb_dri3_open_cookie_t dri3_open;
+	bool has_xfixes;
+};
+
+void x_init_send(xcb_connection_t *c, xcb_screen_t *screen, struct x_init_requests *req);
+int x_init_receive(xcb_connection_t *c, struct x_init_requests *req);
+bool x_get_pixmap_geometry(xcb_connection_t *c, xcb_pixmap_t pixmap, uint32_t *width, uint32_t *height,
+			   uint32_t *depth);
+enum x_window_state {
+	X_WINDOW_ERROR = -1,
+	X_WINDOW_UNMAPPED,
+	X_WINDOW_VIEWABLE,
+};
+enum x_window_state x_get_window_state(xcb_connection_t *c, xcb_window_t window);
+uint32_t x_get_present_capabilities(xcb_connection_t *c, xcb_window_t window);
+struct xshmfence;
+xcb_sync_fence_t x_create_shm_fence(xcb_connection_t *c, xcb_drawable_t drawable, struct xshmfence **shm_fence);
+bool x_check_shm_fence(xcb_connection_t *c, xcb_drawable_t drawable);
+void x_destroy_shm_fence(xcb_connection_t *c, xcb_sync_fence_t fence, struct xshmfence *shm_fence);
+xcb_special_event_t *x_init_special_event_queue(xcb_connection_t *c, xcb_window_t window, uint32_t event_mask,
+						uint32_t *special_ev_stamp);
 void x_uninit_special_event_queue(xcb_connection_t *c, xcb_special_event_t *special_ev);
 void x_draw_to_pixmap(xcb_connection_t *c, xcb_screen_t *screen, xcb_pixmap_t pixmap, uint32_t i);